@@ -3,7 +3,13 @@
 #include <list>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <new>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <ncurses.h>
@@ -15,238 +21,6061 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <set>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <bitset>
+#include <array>
+#include <functional>
+#include <condition_variable>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define TEXT_SEARCH_AVX2 // Chosen at run time when the CPU supports it
+#endif
 
 using namespace std;
 
-struct Letter
+// Read-only private mapping of a file opened by the editor. Lines loaded from
+// the file point straight into the mapping until they are edited, so opening
+// a file does not copy its contents.
+class MappedFile
 {
-    char ch;
-    Letter *next;
+public:
+    MappedFile(const string &filename) : bytes(nullptr), byteCount(0)
+    {
+        // Check first so pipes and devices are never opened (and drained) here
+        struct stat fileStat;
+        if (stat(filename.c_str(), &fileStat) != 0 || !S_ISREG(fileStat.st_mode) || fileStat.st_size == 0)
+        {
+            return;
+        }
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+        if (fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size > 0)
+        {
+            void *mapped = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                bytes = static_cast<const char *>(mapped);
+                byteCount = fileStat.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    bool isOpen() const
+    {
+        return bytes != nullptr;
+    }
+
+    const char *data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return byteCount;
+    }
+
+    // Pass an access pattern hint (MADV_SEQUENTIAL, ...) to the kernel
+    void advise(int advice)
+    {
+        if (bytes != nullptr)
+        {
+            madvise(const_cast<char *>(bytes), byteCount, advice);
+        }
+    }
+
+    ~MappedFile()
+    {
+        if (bytes != nullptr)
+        {
+            munmap(const_cast<char *>(bytes), byteCount);
+        }
+    }
+
+private:
+    const char *bytes;
+    size_t byteCount;
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+// Line text is kept in a gap buffer: the characters live contiguously in
+// `buffer` with an unused gap at the cursor, so typing and deleting next to
+// the last edit position only moves the gap boundaries.
+//
+// A line read from a mapped file starts out as a piece of the original file:
+// `buffer` points into the mapping with the gap at the end and `owned` is
+// false. It is only copied into its own buffer on the first edit, so reading
+// code never needs to tell the two cases apart.
+//
+// Every line is also a node of the LineTree of the paragraph that holds it;
+// length changes are pushed up the tree so cached character counts stay exact.
+class Line
+{
+public:
+    Line() : buffer(nullptr), capacity(0), gapStart(0), gapEnd(0), owned(true)
+    {
+        unlink();
+    }
+
+    // View `len` bytes of a mapped file; the mapping must outlive the line
+    Line(const char *text, size_t len)
+        : buffer(const_cast<char *>(text)), capacity(len), gapStart(len), gapEnd(len), owned(false)
+    {
+        unlink();
+    }
+
+    ~Line()
+    {
+        if (owned)
+        {
+            delete[] buffer;
+        }
+    }
+
+    // Bumped by every edit to any line, so an index built over the text can
+    // tell that it is out of date
+    static atomic<unsigned long long> edits;
+
+    void insertCharAt(int pos, char c)
+    {
+        edits++;
+        materialize();
+        moveGapTo(pos);
+        if (gapStart == gapEnd)
+        {
+            growGap(1);
+        }
+        buffer[gapStart++] = c;
+        lengthChanged(1);
+    }
+
+    void removeCharAt(int pos)
+    {
+        edits++;
+        materialize();
+        moveGapTo(pos);
+        gapEnd++; // Swallow the character after the gap
+        lengthChanged(-1);
+    }
+
+    // Replace `len` characters at `pos` with `text` in one step. Successive
+    // calls that move left to right only slide the gap forward, so any
+    // number of replacements in a line costs one pass over it.
+    void replaceRange(int pos, int len, string_view text)
+    {
+        lengthChanged(splice(pos, len, text));
+    }
+
+    // Append raw text at the end of the line
+    void append(const char *text, size_t len)
+    {
+        if (len == 0)
+        {
+            return;
+        }
+        edits++;
+        materialize();
+        moveGapTo(length());
+        if (gapEnd - gapStart < len)
+        {
+            growGap(len);
+        }
+        memcpy(buffer + gapStart, text, len);
+        gapStart += len;
+        lengthChanged(len);
+    }
+
+    // Append the contents of another line (used when merging lines)
+    void append(const Line &other)
+    {
+        append(other.buffer, other.gapStart);
+        append(other.buffer + other.gapEnd, other.capacity - other.gapEnd);
+    }
+
+    // Cut the line at `pos` and move the text after it into the empty,
+    // detached line `tail`. An unedited mapped line is split without copying.
+    void moveTailTo(int pos, Line *tail)
+    {
+        edits++;
+        int tailLength = length() - pos;
+        if (!owned)
+        {
+            tail->buffer = buffer + pos;
+            tail->capacity = tail->gapStart = tail->gapEnd = tailLength;
+            tail->owned = false;
+            tail->unlink();
+            capacity = gapStart = gapEnd = pos;
+        }
+        else
+        {
+            moveGapTo(pos);
+            tail->append(buffer + gapEnd, tailLength);
+            gapEnd = capacity;
+        }
+        lengthChanged(-tailLength);
+    }
+
+    char charAt(int pos) const
+    {
+        return pos < (int)gapStart ? buffer[pos] : buffer[pos + (gapEnd - gapStart)];
+    }
+
+    void setCharAt(int pos, char c)
+    {
+        edits++;
+        materialize();
+        if (pos < (int)gapStart)
+        {
+            buffer[pos] = c;
+        }
+        else
+        {
+            buffer[pos + (gapEnd - gapStart)] = c;
+        }
+    }
+
+    // Pass every character through `convert` (toupper, tolower). The length
+    // stays the same, so different lines can be converted in parallel.
+    void convertChars(int (*convert)(int))
+    {
+        edits++;
+        materialize();
+        for (size_t i = 0; i < gapStart; ++i)
+        {
+            buffer[i] = convert((unsigned char)buffer[i]);
+        }
+        for (size_t i = gapEnd; i < capacity; ++i)
+        {
+            buffer[i] = convert((unsigned char)buffer[i]);
+        }
+    }
+
+    // Whether test(c) holds for any character, checked on both sides of the
+    // gap without moving it
+    template <class Test>
+    bool anyChar(Test test) const
+    {
+        const unsigned char *text = reinterpret_cast<const unsigned char *>(buffer);
+        return any_of(text, text + gapStart, test) || any_of(text + gapEnd, text + capacity, test);
+    }
+
+    // Draw up to `width` characters starting at column `start`, so long
+    // lines neither wrap into the screen row below nor get built in full
+    void printLine(int start, int width)
+    {
+        size_t from = min((size_t)start, (size_t)length());
+        size_t to = min(from + width, (size_t)length());
+        if (from < gapStart)
+        {
+            addnstr(buffer + from, min(to, gapStart) - from);
+        }
+        if (to > gapStart)
+        {
+            size_t tailFrom = max(from, gapStart);
+            addnstr(buffer + tailFrom + (gapEnd - gapStart), to - tailFrom);
+        }
+    }
+
+    void writeTo(ostream &out) const
+    {
+        out.write(buffer, gapStart);
+        out.write(buffer + gapEnd, capacity - gapEnd);
+    }
+
+    // The text as one contiguous run, for searching without a copy. Moves
+    // the gap to the end, which is free unless the line was edited since.
+    string_view view()
+    {
+        moveGapTo(length());
+        return string_view(buffer, gapStart);
+    }
+
+    // Copy of `len` characters from `pos`, read around the gap so it stays
+    // where the last edit left it
+    string substr(int pos, int len) const
+    {
+        string part;
+        part.reserve(len);
+        size_t from = pos, to = pos + len;
+        if (from < gapStart)
+        {
+            part.append(buffer + from, min(to, gapStart) - from);
+        }
+        if (to > gapStart)
+        {
+            size_t tailFrom = max(from, gapStart);
+            part.append(buffer + tailFrom + (gapEnd - gapStart), to - tailFrom);
+        }
+        return part;
+    }
+
+    string getContent() const
+    {
+        string content;
+        content.reserve(length());
+        content.append(buffer, gapStart);
+        content.append(buffer + gapEnd, capacity - gapEnd);
+        return content;
+    }
+
+    int length() const
+    {
+        return capacity - (gapEnd - gapStart);
+    }
+
+private:
+    friend class LineTree;
+    friend class Document;
+
+    // LineTree links and the counts cached for the subtree rooted here
+    Line *left;
+    Line *right;
+    Line *parent;
+    long long subtreeChars;
+    int subtreeLines;
+    unsigned priority;
+
+    char *buffer;
+    size_t capacity;
+    size_t gapStart; // First free slot of the gap
+    size_t gapEnd;   // First character after the gap
+    bool owned;      // False while `buffer` still points into a mapped file
+
+    Line(const Line &) = delete;
+    Line &operator=(const Line &) = delete;
+
+    void unlink()
+    {
+        left = right = parent = nullptr;
+        priority = 0;
+        subtreeLines = 1;
+        subtreeChars = length();
+    }
+
+    void lengthChanged(long long delta)
+    {
+        for (Line *node = this; node != nullptr; node = node->parent)
+        {
+            node->subtreeChars += delta;
+        }
+    }
+
+    // Replace text without updating the tree counts; returns the change in
+    // length for the caller to pass to lengthChanged()
+    long long splice(int pos, int len, string_view text)
+    {
+        edits++;
+        materialize();
+        moveGapTo(pos);
+        gapEnd += len; // Swallow the replaced characters
+        if (gapEnd - gapStart < text.size())
+        {
+            growGap(text.size());
+        }
+        memcpy(buffer + gapStart, text.data(), text.size());
+        gapStart += text.size();
+        return (long long)text.size() - len;
+    }
+
+    // Copy a mapped line into its own buffer before it is modified, leaving
+    // a gap of at least `extra` bytes
+    void materialize(size_t extra = 0)
+    {
+        if (owned)
+        {
+            return;
+        }
+        const char *text = buffer;
+        size_t len = gapStart;
+        buffer = nullptr;
+        capacity = gapStart = gapEnd = 0;
+        owned = true;
+        if (len + extra > 0)
+        {
+            growGap(len + extra);
+            memcpy(buffer, text, len);
+            gapStart = len;
+        }
+    }
+
+    // Make room for a line to grow by `extra` bytes with one allocation
+    void reserve(size_t extra)
+    {
+        materialize(extra);
+        if (gapEnd - gapStart < extra)
+        {
+            growGap(extra);
+        }
+    }
+
+    // Slide the gap so that it starts at `pos`
+    void moveGapTo(size_t pos)
+    {
+        if (pos < gapStart)
+        {
+            size_t count = gapStart - pos;
+            memmove(buffer + gapEnd - count, buffer + pos, count);
+            gapStart -= count;
+            gapEnd -= count;
+        }
+        else if (pos > gapStart)
+        {
+            size_t count = pos - gapStart;
+            memmove(buffer + gapStart, buffer + gapEnd, count);
+            gapStart += count;
+            gapEnd += count;
+        }
+    }
+
+    // Make the gap at least `needed` bytes wide, doubling the buffer so that
+    // a run of insertions costs amortized O(1) each
+    void growGap(size_t needed)
+    {
+        size_t used = length();
+        size_t grownCapacity = max(max(capacity * 2, used + needed), (size_t)16);
+        char *grown = new char[grownCapacity];
+        size_t tail = capacity - gapEnd;
+        if (gapStart > 0)
+        {
+            memcpy(grown, buffer, gapStart);
+        }
+        if (tail > 0)
+        {
+            memcpy(grown + grownCapacity - tail, buffer + gapEnd, tail);
+        }
+        delete[] buffer;
+        buffer = grown;
+        capacity = grownCapacity;
+        gapEnd = grownCapacity - tail;
+    }
+};
+
+atomic<unsigned long long> Line::edits(0);
+
+// Balanced binary tree (a treap with implicit keys) over the lines of a
+// paragraph. Each node caches the number of lines and characters below it,
+// so finding a row, turning a character offset into (row, col), and
+// inserting or removing a line anywhere are all O(log n).
+class LineTree
+{
+public:
+    class iterator
+    {
+    public:
+        iterator(Line *node) : node(node) {}
+
+        Line *operator*() const
+        {
+            return node;
+        }
+
+        iterator &operator++()
+        {
+            node = successor(node);
+            return *this;
+        }
+
+        bool operator!=(const iterator &other) const
+        {
+            return node != other.node;
+        }
+
+    private:
+        Line *node;
+    };
+
+    LineTree() : root(nullptr) {}
+
+    iterator begin() const
+    {
+        Line *node = root;
+        while (node != nullptr && node->left != nullptr)
+        {
+            node = node->left;
+        }
+        return iterator(node);
+    }
+
+    iterator end() const
+    {
+        return iterator(nullptr);
+    }
+
+    int size() const
+    {
+        return lines(root);
+    }
+
+    long long charCount() const
+    {
+        return chars(root);
+    }
+
+    Line *at(int index) const
+    {
+        Line *node = root;
+        while (node != nullptr)
+        {
+            int leftLines = lines(node->left);
+            if (index < leftLines)
+            {
+                node = node->left;
+            }
+            else if (index == leftLines)
+            {
+                return node;
+            }
+            else
+            {
+                index -= leftLines + 1;
+                node = node->right;
+            }
+        }
+        return nullptr;
+    }
+
+    // Row of a line that belongs to this tree
+    int indexOf(const Line *line) const
+    {
+        int index = lines(line->left);
+        for (const Line *node = line; node->parent != nullptr; node = node->parent)
+        {
+            if (node == node->parent->right)
+            {
+                index += lines(node->parent->left) + 1;
+            }
+        }
+        return index;
+    }
+
+    // Offset of the first character of `row`, counting one newline per line
+    long long offsetOf(int row) const
+    {
+        long long offset = 0;
+        Line *node = root;
+        while (node != nullptr)
+        {
+            int leftLines = lines(node->left);
+            if (row <= leftLines)
+            {
+                if (row == leftLines)
+                {
+                    return offset + chars(node->left) + leftLines;
+                }
+                node = node->left;
+            }
+            else
+            {
+                offset += chars(node->left) + leftLines + node->length() + 1;
+                row -= leftLines + 1;
+                node = node->right;
+            }
+        }
+        return offset;
+    }
+
+    // Map a character offset (newlines included) to a row and column
+    bool locate(long long offset, int &row, int &col) const
+    {
+        row = 0;
+        Line *node = root;
+        while (node != nullptr)
+        {
+            long long leftSpan = chars(node->left) + lines(node->left);
+            if (offset < leftSpan)
+            {
+                node = node->left;
+                continue;
+            }
+            offset -= leftSpan;
+            row += lines(node->left);
+            if (offset <= node->length())
+            {
+                col = offset;
+                return true;
+            }
+            offset -= node->length() + 1;
+            row++;
+            node = node->right;
+        }
+        return false;
+    }
+
+    void insert(int index, Line *line)
+    {
+        line->left = line->right = line->parent = nullptr;
+        line->priority = nextPriority();
+        refresh(line);
+        Line *before, *after;
+        split(root, index, before, after);
+        root = merge(merge(before, line), after);
+        root->parent = nullptr;
+    }
+
+    void push_back(Line *line)
+    {
+        insert(size(), line);
+    }
+
+    // Append many lines at once in O(k + log n)
+    void append(const vector<Line *> &batch)
+    {
+        Line *built = build(batch);
+        root = merge(root, built);
+        if (root != nullptr)
+        {
+            root->parent = nullptr;
+        }
+    }
+
+    // Detach and return the line at `index`; the caller owns it afterwards
+    Line *erase(int index)
+    {
+        Line *before, *rest, *line, *after;
+        split(root, index, before, rest);
+        split(rest, 1, line, after);
+        root = merge(before, after);
+        if (root != nullptr)
+        {
+            root->parent = nullptr;
+        }
+        if (line != nullptr)
+        {
+            line->unlink();
+        }
+        return line;
+    }
+
+private:
+    Line *root;
+
+    static int lines(const Line *node)
+    {
+        return node != nullptr ? node->subtreeLines : 0;
+    }
+
+    static long long chars(const Line *node)
+    {
+        return node != nullptr ? node->subtreeChars : 0;
+    }
+
+    static unsigned nextPriority()
+    {
+        static unsigned state = 2463534242u;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    static void refresh(Line *node)
+    {
+        node->subtreeLines = 1 + lines(node->left) + lines(node->right);
+        node->subtreeChars = node->length() + chars(node->left) + chars(node->right);
+        if (node->left != nullptr)
+        {
+            node->left->parent = node;
+        }
+        if (node->right != nullptr)
+        {
+            node->right->parent = node;
+        }
+    }
+
+    static Line *successor(Line *node)
+    {
+        if (node->right != nullptr)
+        {
+            node = node->right;
+            while (node->left != nullptr)
+            {
+                node = node->left;
+            }
+            return node;
+        }
+        while (node->parent != nullptr && node == node->parent->right)
+        {
+            node = node->parent;
+        }
+        return node->parent;
+    }
+
+    // Split `node` into its first `count` lines and the rest
+    static void split(Line *node, int count, Line *&first, Line *&rest)
+    {
+        if (node == nullptr)
+        {
+            first = rest = nullptr;
+            return;
+        }
+        node->parent = nullptr;
+        if (lines(node->left) < count)
+        {
+            split(node->right, count - lines(node->left) - 1, node->right, rest);
+            first = node;
+        }
+        else
+        {
+            split(node->left, count, first, node->left);
+            rest = node;
+        }
+        refresh(node);
+        if (first != nullptr)
+        {
+            first->parent = nullptr;
+        }
+        if (rest != nullptr)
+        {
+            rest->parent = nullptr;
+        }
+    }
+
+    static Line *merge(Line *first, Line *rest)
+    {
+        if (first == nullptr)
+        {
+            return rest;
+        }
+        if (rest == nullptr)
+        {
+            return first;
+        }
+        if (first->priority > rest->priority)
+        {
+            first->right = merge(first->right, rest);
+            refresh(first);
+            return first;
+        }
+        rest->left = merge(first, rest->left);
+        refresh(rest);
+        return rest;
+    }
+
+    // Build a treap from lines in order using the rightmost-spine stack.
+    // A node's subtree is final once it leaves the spine, so counts are
+    // filled in right then while the node is still in cache.
+    static Line *build(const vector<Line *> &batch)
+    {
+        vector<Line *> spine;
+        for (Line *line : batch)
+        {
+            line->left = line->right = line->parent = nullptr;
+            line->priority = nextPriority();
+            Line *last = nullptr;
+            while (!spine.empty() && spine.back()->priority < line->priority)
+            {
+                last = spine.back();
+                refresh(last);
+                spine.pop_back();
+            }
+            line->left = last;
+            if (!spine.empty())
+            {
+                spine.back()->right = line;
+            }
+            spine.push_back(line);
+        }
+        if (spine.empty())
+        {
+            return nullptr;
+        }
+        for (auto it = spine.rbegin(); it != spine.rend(); ++it)
+        {
+            refresh(*it);
+        }
+        Line *top = spine.front();
+        top->parent = nullptr;
+        return top;
+    }
+};
+
+class Para
+{
+public:
+    LineTree lines;
+
+    void addLine(Line *line)
+    {
+        lines.push_back(line);
+    }
+
+    void addLines(const vector<Line *> &batch)
+    {
+        lines.append(batch);
+    }
+
+    void insertLine(int index, Line *line)
+    {
+        lines.insert(index, line);
+    }
+
+    // Unlink the line at `index` from the paragraph and return it
+    Line *removeLine(int index)
+    {
+        return lines.erase(index);
+    }
+
+    int lineCount()
+    {
+        return lines.size();
+    }
+
+    Line *getLine(int index)
+    {
+        return lines.at(index);
+    }
+};
+
+// Size-class pool for the Line and Para nodes of one document. Nodes are
+// carved out of 64 KB slabs, freed nodes are kept on a free list per size
+// class, and all slabs are returned at once when the pool is destroyed.
+class NodePool
+{
+public:
+    NodePool() : slabUsed(SlabSize), inUse(0)
+    {
+        for (int i = 0; i < ClassCount; ++i)
+        {
+            freeLists[i] = nullptr;
+        }
+    }
+
+    ~NodePool()
+    {
+        for (auto slab : slabs)
+        {
+            free(slab);
+        }
+    }
+
+    template <class T, class... Args>
+    T *create(Args... args)
+    {
+        return new (allocate(sizeof(T))) T(args...);
+    }
+
+    template <class T>
+    void destroy(T *node)
+    {
+        node->~T();
+        release(node, sizeof(T));
+    }
+
+    size_t bytesInUse() const
+    {
+        return inUse;
+    }
+
+    size_t bytesReserved() const
+    {
+        return slabs.size() * SlabSize;
+    }
+
+private:
+    static const size_t SlabSize = 64 * 1024;
+    static const size_t Granularity = 16;
+    static const int ClassCount = 16; // Nodes of up to 256 bytes
+
+    struct FreeNode
+    {
+        FreeNode *next;
+    };
+
+    FreeNode *freeLists[ClassCount];
+    vector<char *> slabs;
+    size_t slabUsed; // Bytes handed out from the newest slab
+    size_t inUse;
+
+    static int classOf(size_t size)
+    {
+        return (size + Granularity - 1) / Granularity - 1;
+    }
+
+    void *allocate(size_t size)
+    {
+        int sizeClass = classOf(size);
+        size_t rounded = (sizeClass + 1) * Granularity;
+        inUse += rounded;
+        if (freeLists[sizeClass] != nullptr)
+        {
+            FreeNode *node = freeLists[sizeClass];
+            freeLists[sizeClass] = node->next;
+            return node;
+        }
+        if (slabUsed + rounded > SlabSize)
+        {
+            slabs.push_back(static_cast<char *>(malloc(SlabSize)));
+            slabUsed = 0;
+        }
+        void *node = slabs.back() + slabUsed;
+        slabUsed += rounded;
+        return node;
+    }
+
+    void release(void *node, size_t size)
+    {
+        int sizeClass = classOf(size);
+        FreeNode *freed = static_cast<FreeNode *>(node);
+        freed->next = freeLists[sizeClass];
+        freeLists[sizeClass] = freed;
+        inUse -= (sizeClass + 1) * Granularity;
+    }
+
+    NodePool(const NodePool &) = delete;
+    NodePool &operator=(const NodePool &) = delete;
+};
+
+// Fenwick (binary indexed) tree over per-paragraph totals. Prefix sums and
+// "which paragraph holds position x" queries are O(log n), and appending a
+// paragraph or changing one total is O(log n) too.
+class Fenwick
+{
+public:
+    Fenwick() : tree(1, 0) {}
+
+    int size() const
+    {
+        return tree.size() - 1;
+    }
+
+    void clear()
+    {
+        tree.assign(1, 0);
+    }
+
+    void push_back(long long value)
+    {
+        int index = tree.size();
+        // A new slot covers (index - lowbit, index]; fill in the part that
+        // is already stored before it
+        tree.push_back(value + prefix(index - 1) - prefix(index - (index & -index)));
+    }
+
+    void add(int index, long long delta)
+    {
+        for (int i = index + 1; i < (int)tree.size(); i += i & -i)
+        {
+            tree[i] += delta;
+        }
+    }
+
+    // Sum of the first `count` elements
+    long long prefix(int count) const
+    {
+        long long sum = 0;
+        for (int i = count; i > 0; i -= i & -i)
+        {
+            sum += tree[i];
+        }
+        return sum;
+    }
+
+    long long total() const
+    {
+        return prefix(size());
+    }
+
+    // Index of the element that covers position `target`, i.e. the smallest
+    // i with prefix(i + 1) > target; `target` is reduced to the position
+    // inside that element. Returns size() when target is past the end.
+    int find(long long &target) const
+    {
+        int index = 0;
+        int step = 1;
+        while (step * 2 < (int)tree.size())
+        {
+            step *= 2;
+        }
+        for (; step > 0; step /= 2)
+        {
+            if (index + step < (int)tree.size() && tree[index + step] <= target)
+            {
+                index += step;
+                target -= tree[index];
+            }
+        }
+        return index;
+    }
+
+private:
+    vector<long long> tree;
+};
+
+// Substring search over contiguous text. Candidate positions are found by
+// comparing the needle's first and last bytes against 32 (AVX2) or 16
+// (SSE2) positions at once, and only where both match is the rest of the
+// needle compared. Without SIMD the first byte is found with memchr.
+//
+// Case-insensitive search folds ASCII letters in place: the needle is
+// lowercased once, and a text byte matches a needle letter when OR-ing it
+// with 0x20 gives that letter. The SIMD filter does the same OR on whole
+// blocks, so ignoring case costs one extra instruction per block.
+class TextSearch
+{
+public:
+    explicit TextSearch(string_view needle, bool caseSensitive = true)
+        : needle(needle), caseSensitive(caseSensitive)
+    {
+        if (!caseSensitive)
+        {
+            for (char &c : this->needle)
+            {
+                c = fold(c);
+            }
+        }
+        firstFold = foldMask(this->needle.empty() ? 0 : this->needle.front());
+        lastFold = foldMask(this->needle.empty() ? 0 : this->needle.back());
+    }
+
+    size_t length() const
+    {
+        return needle.size();
+    }
+
+    // Offset of the first match at or after `from`, or string_view::npos
+    size_t find(string_view text, size_t from = 0) const
+    {
+        size_t k = needle.size();
+        if (k == 0 || k > text.size() || from > text.size() - k)
+        {
+            return k == 0 && from <= text.size() ? from : string_view::npos;
+        }
+        if (k == 1 && firstFold == 0)
+        {
+            const void *hit = memchr(text.data() + from, needle[0], text.size() - from);
+            return hit == nullptr ? string_view::npos : static_cast<const char *>(hit) - text.data();
+        }
+#ifdef TEXT_SEARCH_AVX2
+        if (hasAvx2())
+        {
+            return findAvx2(text, from);
+        }
+#endif
+#ifdef __SSE2__
+        return findSse2(text, from);
+#else
+        return findScalar(text, from);
+#endif
+    }
+
+    // Number of non-overlapping matches
+    int count(string_view text) const
+    {
+        int found = 0;
+        if (needle.empty())
+        {
+            return found;
+        }
+        for (size_t pos = find(text); pos != string_view::npos; pos = find(text, pos + needle.size()))
+        {
+            found++;
+        }
+        return found;
+    }
+
+    // Name of the kernel find() runs on this machine
+    static const char *kernel()
+    {
+#ifdef TEXT_SEARCH_AVX2
+        if (hasAvx2())
+        {
+            return "AVX2";
+        }
+#endif
+#ifdef __SSE2__
+        return "SSE2";
+#else
+        return "scalar";
+#endif
+    }
+
+private:
+    string needle; // Lowercased when case is ignored
+    bool caseSensitive;
+    char firstFold; // 0x20 when the first/last needle byte is a folded letter
+    char lastFold;
+
+    static char fold(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+
+    char foldMask(char c) const
+    {
+        return !caseSensitive && c >= 'a' && c <= 'z' ? 0x20 : 0;
+    }
+
+    // The needle minus its first and last bytes matches at `at`
+    bool middleMatches(const char *at) const
+    {
+        size_t k = needle.size();
+        if (k < 3)
+        {
+            return true;
+        }
+        if (caseSensitive)
+        {
+            return memcmp(at + 1, needle.data() + 1, k - 2) == 0;
+        }
+        for (size_t j = 1; j + 1 < k; ++j)
+        {
+            if (fold(at[j]) != needle[j])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Candidates start in [from, text.size() - k]
+    size_t findScalar(string_view text, size_t from) const
+    {
+        size_t k = needle.size();
+        const char *base = text.data();
+        size_t last = text.size() - k;
+        for (size_t i = from; i <= last; ++i)
+        {
+            if (firstFold == 0)
+            {
+                const char *hit = static_cast<const char *>(memchr(base + i, needle[0], last - i + 1));
+                if (hit == nullptr)
+                {
+                    break;
+                }
+                i = hit - base;
+            }
+            else if ((base[i] | firstFold) != needle[0])
+            {
+                continue;
+            }
+            if ((base[i + k - 1] | lastFold) == needle[k - 1] && middleMatches(base + i))
+            {
+                return i;
+            }
+        }
+        return string_view::npos;
+    }
+
+#ifdef __SSE2__
+    size_t findSse2(string_view text, size_t from) const
+    {
+        size_t k = needle.size();
+        const char *base = text.data();
+        size_t last = text.size() - k;
+        const __m128i first = _mm_set1_epi8(needle[0]);
+        const __m128i final = _mm_set1_epi8(needle[k - 1]);
+        const __m128i firstMask = _mm_set1_epi8(firstFold);
+        const __m128i finalMask = _mm_set1_epi8(lastFold);
+        size_t i = from;
+        for (; i + 15 <= last; i += 16)
+        {
+            __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(base + i));
+            __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(base + i + k - 1));
+            head = _mm_or_si128(head, firstMask);
+            tail = _mm_or_si128(tail, finalMask);
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, final)));
+            while (mask != 0)
+            {
+                size_t at = i + __builtin_ctz(mask);
+                if (middleMatches(base + at))
+                {
+                    return at;
+                }
+                mask &= mask - 1;
+            }
+        }
+        return findScalar(text, i);
+    }
+#endif
+
+#ifdef TEXT_SEARCH_AVX2
+    static bool hasAvx2()
+    {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    __attribute__((target("avx2"))) size_t findAvx2(string_view text, size_t from) const
+    {
+        size_t k = needle.size();
+        const char *base = text.data();
+        size_t last = text.size() - k;
+        const __m256i first = _mm256_set1_epi8(needle[0]);
+        const __m256i final = _mm256_set1_epi8(needle[k - 1]);
+        const __m256i firstMask = _mm256_set1_epi8(firstFold);
+        const __m256i finalMask = _mm256_set1_epi8(lastFold);
+        size_t i = from;
+        for (; i + 31 <= last; i += 32)
+        {
+            __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(base + i));
+            __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(base + i + k - 1));
+            head = _mm256_or_si256(head, firstMask);
+            tail = _mm256_or_si256(tail, finalMask);
+            unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, final)));
+            while (mask != 0)
+            {
+                size_t at = i + __builtin_ctz(mask);
+                if (middleMatches(base + at))
+                {
+                    return at;
+                }
+                mask &= mask - 1;
+            }
+        }
+        // Lines are short, so finish the last few positions 16 at a time
+        return findSse2(text, i);
+    }
+#endif
+};
+
+// Aho-Corasick automaton over a set of patterns: one pass over a text finds
+// every occurrence of every pattern, overlapping ones included. The
+// transitions form a full DFA indexed by byte class; bytes that occur in no
+// pattern share class 0, so the table stays small for thousands of patterns.
+// Transitions hold the target's row offset and the states that report
+// matches are numbered first, so a scan step is two loads and a compare.
+class MultiSearch
+{
+public:
+    explicit MultiSearch(const vector<string> &patterns) : patterns(patterns), classes(1)
+    {
+        fill(byteClass, byteClass + 256, 0);
+        for (const auto &pattern : patterns)
+        {
+            for (unsigned char c : pattern)
+            {
+                if (byteClass[c] == 0)
+                {
+                    byteClass[c] = classes++;
+                }
+            }
+        }
+
+        addState();
+        for (int index = 0; index < (int)patterns.size(); ++index)
+        {
+            insert(index);
+        }
+        link();
+    }
+
+    int patternCount() const
+    {
+        return patterns.size();
+    }
+
+    const string &pattern(int index) const
+    {
+        return patterns[index];
+    }
+
+    int stateCount() const
+    {
+        return terminal.size();
+    }
+
+    // Call hit(patternIndex, start) for every occurrence in `text`
+    template <class Hit>
+    void scan(string_view text, Hit hit) const
+    {
+        int row = startRow;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            row = next[row + byteClass[(unsigned char)text[i]]];
+            if (row < outputRows)
+            {
+                int state = row / classes;
+                for (int s = terminal[state] >= 0 ? state : outputLink[state]; s >= 0; s = outputLink[s])
+                {
+                    hit(terminal[s], i + 1 - patterns[terminal[s]].size());
+                }
+            }
+        }
+    }
+
+private:
+    vector<string> patterns;
+    int byteClass[256];
+    int classes;
+    vector<int> next;       // stateCount() x classes transitions
+    vector<int> terminal;   // Pattern that ends in a state, or -1
+    vector<int> outputLink; // Nearest suffix state that ends a pattern, or -1
+    int startRow;           // Row of the root state
+    int outputRows;         // Rows below this belong to states that report
+
+    int addState()
+    {
+        next.insert(next.end(), classes, -1);
+        terminal.push_back(-1);
+        outputLink.push_back(-1);
+        return terminal.size() - 1;
+    }
+
+    void insert(int index)
+    {
+        int state = 0;
+        for (unsigned char c : patterns[index])
+        {
+            int target = next[state * classes + byteClass[c]];
+            if (target < 0)
+            {
+                target = addState();
+                next[state * classes + byteClass[c]] = target;
+            }
+            state = target;
+        }
+        if (terminal[state] < 0)
+        {
+            terminal[state] = index; // A repeated pattern keeps its first index
+        }
+    }
+
+    // Breadth-first pass that computes failure links and fills in every
+    // missing transition with the one the failure state takes
+    void link()
+    {
+        vector<int> fail(stateCount(), 0);
+        deque<int> queue;
+        for (int c = 0; c < classes; ++c)
+        {
+            int &target = next[c];
+            if (target < 0)
+            {
+                target = 0;
+            }
+            else
+            {
+                queue.push_back(target);
+            }
+        }
+        while (!queue.empty())
+        {
+            int state = queue.front();
+            queue.pop_front();
+            for (int c = 0; c < classes; ++c)
+            {
+                int &target = next[state * classes + c];
+                int fallback = next[fail[state] * classes + c];
+                if (target < 0)
+                {
+                    target = fallback;
+                    continue;
+                }
+                fail[target] = fallback;
+                outputLink[target] = terminal[fallback] >= 0 ? fallback : outputLink[fallback];
+                queue.push_back(target);
+            }
+        }
+        renumber();
+    }
+
+    // Move the states that report matches to the front and turn every
+    // transition into the row offset of its target
+    void renumber()
+    {
+        int count = stateCount();
+        vector<int> order;
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            for (int state = 0; state < count; ++state)
+            {
+                bool reports = terminal[state] >= 0 || outputLink[state] >= 0;
+                if (reports == (pass == 0))
+                {
+                    order.push_back(state);
+                }
+            }
+            if (pass == 0)
+            {
+                outputRows = order.size() * classes;
+            }
+        }
+        vector<int> newIndex(count);
+        for (int i = 0; i < count; ++i)
+        {
+            newIndex[order[i]] = i;
+        }
+
+        vector<int> rows(next.size());
+        vector<int> terminals(count);
+        vector<int> links(count);
+        for (int i = 0; i < count; ++i)
+        {
+            int state = order[i];
+            for (int c = 0; c < classes; ++c)
+            {
+                rows[i * classes + c] = newIndex[next[state * classes + c]] * classes;
+            }
+            terminals[i] = terminal[state];
+            links[i] = outputLink[state] >= 0 ? newIndex[outputLink[state]] : -1;
+        }
+        next.swap(rows);
+        terminal.swap(terminals);
+        outputLink.swap(links);
+        startRow = newIndex[0] * classes;
+    }
+};
+
+// Regular expressions compiled to a Thompson NFA. Lines are first run
+// through a DFA built lazily from the NFA: each DFA state is a set of NFA
+// states, created the first time a byte leads to it and cached, so a line
+// costs one table lookup per byte and there is no backtracking. Only lines
+// the DFA accepts go through the Pike VM, which steps all NFA threads in
+// lock step to find leftmost-first matches and their capture groups, still
+// in time linear in the line.
+//
+// Syntax: literals, ., [a-z] and [^...], \d \w \s \D \W \S, escapes such as
+// \. and \t, ^ and $ (start and end of the line), groups (...) and (?:...),
+// | and the quantifiers * + ? {m} {m,} {m,n}, lazy with a trailing ?.
+class Regex
+{
+public:
+    static const int MaxGroups = 10; // \0 (the whole match) to \9
+
+    explicit Regex(const string &pattern, bool caseSensitive = true)
+        : pattern(pattern), caseSensitive(caseSensitive), at(0), groups(1), beginState(-1)
+    {
+        int root = parseAlternation();
+        if (errorText.empty() && at < pattern.size())
+        {
+            fail("unmatched )");
+        }
+        if (errorText.empty())
+        {
+            emit(group(0, root));
+            program.push_back({Accept, 0, 0});
+            if (program.size() > MaxProgram)
+            {
+                fail("pattern too large");
+            }
+        }
+        nodes.clear();
+        marks.assign(program.size(), 0);
+        findFirstBytes();
+    }
+
+    bool valid() const
+    {
+        return errorText.empty();
+    }
+
+    // What is wrong with the pattern, and where
+    const string &error() const
+    {
+        return errorText;
+    }
+
+    int groupCount() const
+    {
+        return groups;
+    }
+
+    // Does the pattern match anywhere in the line? Runs the DFA only.
+    bool matches(string_view text)
+    {
+        if (beginState < 0)
+        {
+            beginState = intern(closure({0}, true, false), true);
+        }
+        int state = beginState;
+        for (unsigned char c : text)
+        {
+            if (states[state].accepting)
+            {
+                return true;
+            }
+            int next = transitions[state * 256 + c];
+            state = next >= 0 ? next : step(state, c);
+        }
+        return states[state].accepting || states[state].acceptsAtEnd;
+    }
+
+    // Leftmost-first match starting at or after `from`. On success
+    // found[2 * g] and found[2 * g + 1] hold the bounds of group g, -1 when
+    // the group did not take part.
+    bool find(string_view text, size_t from, vector<int> &found)
+    {
+        int slots = 2 * groups;
+        bool matched = false;
+        caps.resize(slots);
+        current.clear(nextGeneration());
+        for (size_t pos = from; pos <= text.size(); ++pos)
+        {
+            if (!matched)
+            {
+                if (current.pcs.empty() && pos > 0 && skippable)
+                {
+                    pos = skipToFirstByte(text, pos);
+                    if (pos == text.size())
+                    {
+                        break;
+                    }
+                }
+                fill(caps.begin(), caps.end(), -1);
+                addThread(current, 0, pos, text, caps);
+            }
+            if (current.pcs.empty() && matched)
+            {
+                break;
+            }
+            next.clear(nextGeneration());
+            for (size_t t = 0; t < current.pcs.size(); ++t)
+            {
+                const Inst &inst = program[current.pcs[t]];
+                const int *threadCaps = &current.caps[t * slots];
+                if (inst.op == Accept)
+                {
+                    found.assign(threadCaps, threadCaps + slots);
+                    matched = true;
+                    break; // Threads after this one have lower priority
+                }
+                if (pos < text.size() && sets[inst.x][(unsigned char)text[pos]])
+                {
+                    caps.assign(threadCaps, threadCaps + slots);
+                    addThread(next, current.pcs[t] + 1, pos + 1, text, caps);
+                }
+            }
+            swap(current, next);
+        }
+        return matched;
+    }
+
+    // Number of non-overlapping matches in the line
+    size_t count(string_view text)
+    {
+        size_t counted = 0;
+        forEachMatch(text, [&](const vector<int> &)
+                     { counted++; });
+        return counted;
+    }
+
+    // Call hit(found) for every non-overlapping match, left to right. An
+    // empty match moves the search on by one character.
+    template <class Hit>
+    void forEachMatch(string_view text, Hit hit)
+    {
+        if (!matches(text))
+        {
+            return;
+        }
+        vector<int> found;
+        size_t from = 0;
+        while (from <= text.size() && find(text, from, found))
+        {
+            hit(found);
+            from = found[1] > found[0] ? found[1] : found[1] + 1;
+        }
+    }
+
+    // The replacement for a match: \0 to \9 insert groups, \\ a backslash
+    static string expand(string_view text, const vector<int> &found, const string &replacement)
+    {
+        string result;
+        for (size_t i = 0; i < replacement.size(); ++i)
+        {
+            char c = replacement[i];
+            if (c != '\\' || i + 1 == replacement.size())
+            {
+                result += c;
+                continue;
+            }
+            c = replacement[++i];
+            int g = c - '0';
+            if (g >= 0 && g <= 9)
+            {
+                if (2 * g + 1 < (int)found.size() && found[2 * g] >= 0)
+                {
+                    result.append(text.substr(found[2 * g], found[2 * g + 1] - found[2 * g]));
+                }
+            }
+            else
+            {
+                result += c == 't' ? '\t' : c;
+            }
+        }
+        return result;
+    }
+
+private:
+    static const size_t MaxProgram = 20000;
+    static const size_t MaxStates = 4096; // The DFA cache starts over beyond this
+
+    enum Op
+    {
+        Bytes,     // Read one byte of set x
+        Split,     // Try x, then y
+        Jump,      // Go to x
+        Save,      // Record the position in capture slot x
+        LineStart, // Only at the start of the line
+        LineEnd,   // Only at the end of the line
+        Accept
+    };
+
+    struct Inst
+    {
+        Op op;
+        int x;
+        int y;
+    };
+
+    // Syntax tree, only kept while compiling
+    struct Node
+    {
+        enum Kind
+        {
+            Set,
+            Empty,
+            Concat,
+            Alternate,
+            Repeat,
+            Group,
+            Start,
+            End
+        } kind;
+        int value;        // Set index or group number
+        vector<int> kids; // Node indexes
+        int min;
+        int max; // -1 for no limit
+        bool greedy;
+    };
+
+    // Threads of the Pike VM, in priority order, with their capture slots
+    struct ThreadList
+    {
+        vector<int> pcs;
+        vector<int> caps;
+        unsigned generation = 0;
+
+        void clear(unsigned next)
+        {
+            pcs.clear();
+            caps.clear();
+            generation = next;
+        }
+    };
+
+    struct DfaState
+    {
+        vector<int> pcs; // NFA states waiting to read a byte, Accept, or pending $
+        bool accepting;
+        bool acceptsAtEnd;
+    };
+
+    string pattern;
+    bool caseSensitive;
+    size_t at; // Parse position
+    int groups;
+    string errorText;
+    vector<Node> nodes;
+    vector<bitset<256>> sets;
+    vector<Inst> program;
+
+    vector<unsigned> marks; // Generation at which each NFA state was last visited
+    unsigned generation = 0;
+    ThreadList current;
+    ThreadList next;
+    vector<int> caps; // Capture slots of the thread being added
+
+    // Bytes a match past the start of the line can begin with. While no
+    // thread is alive the VM skips to the next of them, unless the pattern
+    // can match the empty string.
+    bitset<256> firstBytes;
+    bool skippable;
+    int onlyFirstByte; // The one byte in firstBytes, or -1
+
+    vector<DfaState> states;
+    vector<int> transitions; // 256 per state, -1 until computed
+    unordered_map<string, int> stateIds;
+    int beginState;
+
+    void findFirstBytes()
+    {
+        skippable = valid();
+        for (int pc : valid() ? closure({0}, false, false) : vector<int>())
+        {
+            if (program[pc].op == Bytes)
+            {
+                firstBytes |= sets[program[pc].x];
+            }
+            else
+            {
+                skippable = false; // Accept or a pending $
+            }
+        }
+        onlyFirstByte = -1;
+        if (firstBytes.count() == 1)
+        {
+            for (int c = 0; c < 256; ++c)
+            {
+                onlyFirstByte = firstBytes[c] ? c : onlyFirstByte;
+            }
+        }
+    }
+
+    size_t skipToFirstByte(string_view text, size_t pos) const
+    {
+        if (onlyFirstByte >= 0)
+        {
+            const void *hit = memchr(text.data() + pos, onlyFirstByte, text.size() - pos);
+            return hit == nullptr ? text.size() : static_cast<const char *>(hit) - text.data();
+        }
+        while (pos < text.size() && !firstBytes[(unsigned char)text[pos]])
+        {
+            ++pos;
+        }
+        return pos;
+    }
+
+    unsigned nextGeneration()
+    {
+        if (++generation == 0)
+        {
+            fill(marks.begin(), marks.end(), 0);
+            generation = 1;
+        }
+        return generation;
+    }
+
+    void fail(const string &what)
+    {
+        if (errorText.empty())
+        {
+            errorText = what + " at position " + to_string(min(at, pattern.size()) + 1);
+        }
+    }
+
+    int node(Node::Kind kind, int value = 0)
+    {
+        nodes.push_back({kind, value, {}, 0, 0, true});
+        return nodes.size() - 1;
+    }
+
+    int group(int number, int kid)
+    {
+        int made = node(Node::Group, number);
+        nodes[made].kids.push_back(kid);
+        return made;
+    }
+
+    // A node reading one byte of `bytes` (of any other byte if `negate`)
+    int set(const bitset<256> &bytes, bool negate = false)
+    {
+        bitset<256> folded = bytes;
+        if (!caseSensitive)
+        {
+            for (int c = 0; c < 256; ++c)
+            {
+                if (bytes[c] && isalpha(c))
+                {
+                    folded[tolower(c)] = folded[toupper(c)] = true;
+                }
+            }
+        }
+        if (negate)
+        {
+            folded.flip();
+        }
+        sets.push_back(folded);
+        return node(Node::Set, sets.size() - 1);
+    }
+
+    int parseAlternation()
+    {
+        int first = parseConcatenation();
+        if (at >= pattern.size() || pattern[at] != '|')
+        {
+            return first;
+        }
+        int alternate = node(Node::Alternate);
+        nodes[alternate].kids.push_back(first);
+        while (errorText.empty() && at < pattern.size() && pattern[at] == '|')
+        {
+            at++;
+            int kid = parseConcatenation();
+            nodes[alternate].kids.push_back(kid);
+        }
+        return alternate;
+    }
+
+    int parseConcatenation()
+    {
+        int concat = node(Node::Concat);
+        while (errorText.empty() && at < pattern.size() && pattern[at] != '|' && pattern[at] != ')')
+        {
+            int kid = parseRepeat();
+            nodes[concat].kids.push_back(kid);
+        }
+        return concat;
+    }
+
+    int parseRepeat()
+    {
+        int atom = parseAtom();
+        while (errorText.empty() && at < pattern.size())
+        {
+            int low, high;
+            char c = pattern[at];
+            if (c == '*' || c == '+' || c == '?')
+            {
+                low = c == '+' ? 1 : 0;
+                high = c == '?' ? 1 : -1;
+                at++;
+            }
+            else if (c != '{' || !parseBounds(low, high))
+            {
+                break;
+            }
+            Node::Kind kind = nodes[atom].kind;
+            if (kind == Node::Start || kind == Node::End)
+            {
+                fail("nothing to repeat");
+                break;
+            }
+            int repeat = node(Node::Repeat);
+            nodes[repeat].kids.push_back(atom);
+            nodes[repeat].min = low;
+            nodes[repeat].max = high;
+            if (at < pattern.size() && pattern[at] == '?')
+            {
+                nodes[repeat].greedy = false;
+                at++;
+            }
+            atom = repeat;
+        }
+        return atom;
+    }
+
+    // {m}, {m,} or {m,n}; anything else leaves the brace as a literal
+    bool parseBounds(int &low, int &high)
+    {
+        size_t start = at;
+        auto number = [&](int &value)
+        {
+            size_t digits = at;
+            value = 0;
+            while (at < pattern.size() && isdigit((unsigned char)pattern[at]) && value <= 1000)
+            {
+                value = value * 10 + (pattern[at++] - '0');
+            }
+            return at > digits;
+        };
+        at++;
+        if (!number(low))
+        {
+            at = start;
+            return false;
+        }
+        high = low;
+        if (at < pattern.size() && pattern[at] == ',')
+        {
+            at++;
+            if (!number(high))
+            {
+                high = -1;
+            }
+        }
+        if (at >= pattern.size() || pattern[at] != '}')
+        {
+            at = start;
+            return false;
+        }
+        at++;
+        if (low > 1000 || high > 1000 || (high >= 0 && high < low))
+        {
+            fail("bad repetition count");
+        }
+        return true;
+    }
+
+    int parseAtom()
+    {
+        char c = pattern[at++];
+        bitset<256> bytes;
+        switch (c)
+        {
+        case '(':
+        {
+            bool capture = true;
+            if (pattern.compare(at, 2, "?:") == 0)
+            {
+                capture = false;
+                at += 2;
+            }
+            int number = capture ? groups++ : 0;
+            int inner = parseAlternation();
+            if (at >= pattern.size() || pattern[at] != ')')
+            {
+                fail("missing )");
+                return inner;
+            }
+            at++;
+            return capture ? group(number, inner) : inner;
+        }
+        case '*':
+        case '+':
+        case '?':
+            fail("nothing to repeat");
+            return node(Node::Empty);
+        case '[':
+            return parseClass();
+        case '.':
+            return set(bytes.set());
+        case '^':
+            return node(Node::Start);
+        case '$':
+            return node(Node::End);
+        case '\\':
+            if (at >= pattern.size())
+            {
+                fail("trailing backslash");
+                return node(Node::Empty);
+            }
+            return set(escape(pattern[at++]));
+        default:
+            bytes[(unsigned char)c] = true;
+            return set(bytes);
+        }
+    }
+
+    static bool isClassEscape(char c)
+    {
+        return c != '\0' && strchr("dwsDWS", c) != nullptr;
+    }
+
+    // The bytes an escape such as \d or \. stands for
+    static bitset<256> escape(char c)
+    {
+        bitset<256> bytes;
+        if (!isClassEscape(c))
+        {
+            bytes[(unsigned char)(c == 't' ? '\t' : c)] = true;
+            return bytes;
+        }
+        char lower = tolower(c);
+        for (int b = 0; b < 256; ++b)
+        {
+            bool in = lower == 'd' ? isdigit(b) : lower == 'w' ? isalnum(b) || b == '_' : isspace(b);
+            bytes[b] = in != (c != lower); // Upper case negates
+        }
+        return bytes;
+    }
+
+    int parseClass()
+    {
+        bitset<256> bytes;
+        bool negate = at < pattern.size() && pattern[at] == '^';
+        if (negate)
+        {
+            at++;
+        }
+        bool first = true;
+        while (at < pattern.size() && (pattern[at] != ']' || first))
+        {
+            first = false;
+            unsigned char low = pattern[at++];
+            if (low == '\\' && at < pattern.size())
+            {
+                char c = pattern[at++];
+                if (isClassEscape(c))
+                {
+                    bytes |= escape(c);
+                    continue;
+                }
+                low = c == 't' ? '\t' : c;
+            }
+            unsigned char high = low;
+            if (at + 1 < pattern.size() && pattern[at] == '-' && pattern[at + 1] != ']')
+            {
+                high = pattern[at + 1];
+                at += 2;
+                if (high == '\\' && at < pattern.size())
+                {
+                    high = pattern[at++];
+                }
+                if (high < low)
+                {
+                    fail("bad range in []");
+                    return node(Node::Empty);
+                }
+            }
+            for (int b = low; b <= high; ++b)
+            {
+                bytes[b] = true;
+            }
+        }
+        if (at >= pattern.size())
+        {
+            fail("missing ]");
+            return node(Node::Empty);
+        }
+        at++;
+        return set(bytes, negate);
+    }
+
+    // Append the instructions for a node; Split prefers x over y
+    void emit(int index)
+    {
+        if (program.size() > MaxProgram)
+        {
+            return; // Reported by the constructor
+        }
+        const Node &n = nodes[index];
+        switch (n.kind)
+        {
+        case Node::Set:
+            program.push_back({Bytes, n.value, 0});
+            break;
+        case Node::Empty:
+            break;
+        case Node::Start:
+            program.push_back({LineStart, 0, 0});
+            break;
+        case Node::End:
+            program.push_back({LineEnd, 0, 0});
+            break;
+        case Node::Concat:
+            for (int kid : n.kids)
+            {
+                emit(kid);
+            }
+            break;
+        case Node::Group:
+            program.push_back({Save, 2 * n.value, 0});
+            emit(n.kids[0]);
+            program.push_back({Save, 2 * n.value + 1, 0});
+            break;
+        case Node::Alternate:
+        {
+            vector<int> jumps;
+            for (size_t k = 0; k + 1 < n.kids.size(); ++k)
+            {
+                int split = program.size();
+                program.push_back({Split, split + 1, 0});
+                emit(n.kids[k]);
+                jumps.push_back(program.size());
+                program.push_back({Jump, 0, 0});
+                program[split].y = program.size();
+            }
+            emit(n.kids.back());
+            for (int jump : jumps)
+            {
+                program[jump].x = program.size();
+            }
+            break;
+        }
+        case Node::Repeat:
+        {
+            for (int k = 0; k < n.min; ++k)
+            {
+                emit(n.kids[0]);
+            }
+            if (n.max < 0)
+            {
+                int split = program.size();
+                program.push_back({Split, 0, 0});
+                emit(n.kids[0]);
+                program.push_back({Jump, split, 0});
+                preferSplit(split, split + 1, program.size(), n.greedy);
+            }
+            else
+            {
+                // Each optional copy may skip straight past all the others
+                vector<int> splits;
+                for (int k = n.min; k < n.max; ++k)
+                {
+                    splits.push_back(program.size());
+                    program.push_back({Split, 0, 0});
+                    emit(n.kids[0]);
+                }
+                for (int split : splits)
+                {
+                    preferSplit(split, split + 1, program.size(), n.greedy);
+                }
+            }
+            break;
+        }
+        }
+    }
+
+    void preferSplit(int split, int body, int out, bool greedy)
+    {
+        program[split].x = greedy ? body : out;
+        program[split].y = greedy ? out : body;
+    }
+
+    // Add a Pike VM thread at `pc`, following jumps, splits and saves in
+    // priority order
+    void addThread(ThreadList &list, int pc, size_t pos, string_view text, vector<int> &caps)
+    {
+        if (marks[pc] == list.generation)
+        {
+            return;
+        }
+        marks[pc] = list.generation;
+        const Inst &inst = program[pc];
+        switch (inst.op)
+        {
+        case Jump:
+            addThread(list, inst.x, pos, text, caps);
+            break;
+        case Split:
+            addThread(list, inst.x, pos, text, caps);
+            addThread(list, inst.y, pos, text, caps);
+            break;
+        case Save:
+        {
+            int saved = caps[inst.x];
+            caps[inst.x] = pos;
+            addThread(list, pc + 1, pos, text, caps);
+            caps[inst.x] = saved;
+            break;
+        }
+        case LineStart:
+            if (pos == 0)
+            {
+                addThread(list, pc + 1, pos, text, caps);
+            }
+            break;
+        case LineEnd:
+            if (pos == text.size())
+            {
+                addThread(list, pc + 1, pos, text, caps);
+            }
+            break;
+        default:
+            list.pcs.push_back(pc);
+            list.caps.insert(list.caps.end(), caps.begin(), caps.end());
+            break;
+        }
+    }
+
+    // NFA states reachable from `pcs` without reading a byte, sorted. ^ is
+    // passed only at the start of the line and $ only at its end; otherwise
+    // a $ is kept in the set as pending.
+    vector<int> closure(vector<int> pcs, bool atStart, bool atEnd)
+    {
+        vector<int> reached;
+        nextGeneration();
+        while (!pcs.empty())
+        {
+            int pc = pcs.back();
+            pcs.pop_back();
+            if (marks[pc] == generation)
+            {
+                continue;
+            }
+            marks[pc] = generation;
+            const Inst &inst = program[pc];
+            switch (inst.op)
+            {
+            case Jump:
+                pcs.push_back(inst.x);
+                break;
+            case Split:
+                pcs.push_back(inst.x);
+                pcs.push_back(inst.y);
+                break;
+            case Save:
+                pcs.push_back(pc + 1);
+                break;
+            case LineStart:
+                if (atStart)
+                {
+                    pcs.push_back(pc + 1);
+                }
+                break;
+            case LineEnd:
+                if (atEnd)
+                {
+                    pcs.push_back(pc + 1);
+                }
+                else
+                {
+                    reached.push_back(pc);
+                }
+                break;
+            default:
+                reached.push_back(pc);
+                break;
+            }
+        }
+        sort(reached.begin(), reached.end());
+        return reached;
+    }
+
+    // The DFA state for a set of NFA states, made on first use
+    int intern(const vector<int> &pcs, bool atStart)
+    {
+        string key(reinterpret_cast<const char *>(pcs.data()), pcs.size() * sizeof(int));
+        key += atStart ? 'B' : '-';
+        auto found = stateIds.find(key);
+        if (found != stateIds.end())
+        {
+            return found->second;
+        }
+        if (states.size() >= MaxStates)
+        {
+            // Start over rather than grow without bound
+            states.clear();
+            transitions.clear();
+            stateIds.clear();
+            beginState = -1;
+        }
+
+        DfaState state{pcs, false, false};
+        vector<int> pending;
+        for (int pc : pcs)
+        {
+            state.accepting |= program[pc].op == Accept;
+            if (program[pc].op == LineEnd)
+            {
+                pending.push_back(pc);
+            }
+        }
+        for (int pc : closure(pending, atStart, true))
+        {
+            state.acceptsAtEnd |= program[pc].op == Accept;
+        }
+        states.push_back(state);
+        transitions.resize(states.size() * 256, -1);
+        stateIds[key] = states.size() - 1;
+        return states.size() - 1;
+    }
+
+    // Follow byte `c` out of a DFA state, making the target state if needed.
+    // The start state is merged into every target, so a match may begin at
+    // any byte.
+    int step(int state, unsigned char c)
+    {
+        vector<int> moved{0};
+        for (int pc : states[state].pcs)
+        {
+            if (program[pc].op == Bytes && sets[program[pc].x][c])
+            {
+                moved.push_back(pc + 1);
+            }
+        }
+        size_t before = states.size();
+        int target = intern(closure(moved, false, false), false);
+        if (states.size() >= before) // Unless the cache was just emptied
+        {
+            transitions[state * 256 + c] = target;
+        }
+        return target;
+    }
+};
+
+// Where a search matched: document row and column, and how many
+// characters matched
+struct TextMatch
+{
+    int row;
+    int col;
+    int length;
+};
+
+// Worker threads that whole-document commands hand their chunks of lines
+// to. Each thread has its own queue: a job's tasks are dealt out in
+// contiguous runs, every thread takes from the front of its own queue and,
+// once that is empty, steals from the back of the others, so a few slow
+// chunks (very long lines, many matches) do not leave cores idle. The
+// calling thread works as well, and the call returns when every task of
+// the job has run.
+class WorkPool
+{
+public:
+    // The pool the editor uses, one thread per core
+    static WorkPool &shared()
+    {
+        static WorkPool pool(max(1u, thread::hardware_concurrency()));
+        return pool;
+    }
+
+    explicit WorkPool(int threadCount) : queues(threadCount), queued(0), stopping(false)
+    {
+        for (int t = 1; t < threadCount; ++t)
+        {
+            workers.emplace_back(&WorkPool::workLoop, this, t);
+        }
+    }
+
+    ~WorkPool()
+    {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Threads that run tasks, the caller's included
+    int threadCount() const
+    {
+        return queues.size();
+    }
+
+    // Which of them is running the current task, in [0, threadCount()); the
+    // caller is 0. Lets a job keep state per thread across its tasks.
+    static int threadIndex()
+    {
+        return currentIndex();
+    }
+
+    // Run work(i) for every i in [0, count)
+    template <class Work>
+    void forEach(size_t count, Work work)
+    {
+        if (queues.size() == 1 || count <= 1)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                work(i);
+            }
+            return;
+        }
+        Job job;
+        job.run = [&](size_t i)
+        { work(i); };
+        job.remaining = count;
+        {
+            // Counted before any task can be taken, so `queued` never drops
+            // below zero
+            lock_guard<mutex> guard(sleepLock);
+            queued += count;
+        }
+        size_t threads = queues.size();
+        for (size_t q = 0; q < threads; ++q)
+        {
+            lock_guard<mutex> guard(queues[q].lock);
+            for (size_t i = count * q / threads; i < count * (q + 1) / threads; ++i)
+            {
+                queues[q].tasks.push_back({&job, i});
+            }
+        }
+        wake.notify_all();
+        while (job.remaining > 0)
+        {
+            if (!runOne(0))
+            {
+                this_thread::yield(); // The last tasks are running elsewhere
+            }
+        }
+    }
+
+    // map(i) for every i in [0, count), folded into `initial` with
+    // combine() in index order
+    template <class T, class Map, class Combine>
+    T reduce(size_t count, T initial, Map map, Combine combine)
+    {
+        vector<T> partial(count);
+        forEach(count, [&](size_t i)
+                { partial[i] = map(i); });
+        for (auto &value : partial)
+        {
+            initial = combine(move(initial), move(value));
+        }
+        return initial;
+    }
+
+private:
+    struct Job
+    {
+        function<void(size_t)> run;
+        atomic<size_t> remaining;
+    };
+
+    struct Task
+    {
+        Job *job;
+        size_t index;
+    };
+
+    struct Queue
+    {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<Queue> queues; // One per thread; the caller uses queues[0]
+    vector<thread> workers;
+    atomic<size_t> queued; // Tasks not taken yet
+    mutex sleepLock;
+    condition_variable wake;
+    bool stopping;
+
+    static int &currentIndex()
+    {
+        static thread_local int index = 0;
+        return index;
+    }
+
+    void workLoop(int self)
+    {
+        currentIndex() = self;
+        while (true)
+        {
+            if (runOne(self))
+            {
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [&]
+                      { return stopping || queued > 0; });
+            if (stopping)
+            {
+                return;
+            }
+        }
+    }
+
+    bool runOne(int self)
+    {
+        Task task;
+        if (!take(self, task))
+        {
+            return false;
+        }
+        task.job->run(task.index);
+        task.job->remaining--; // The job may be gone once this reaches 0
+        return true;
+    }
+
+    bool take(int self, Task &task)
+    {
+        for (size_t k = 0; k < queues.size(); ++k)
+        {
+            Queue &queue = queues[(self + k) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+            {
+                continue;
+            }
+            if (k == 0)
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = queue.tasks.back(); // Steal
+                queue.tasks.pop_back();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    WorkPool(const WorkPool &) = delete;
+    WorkPool &operator=(const WorkPool &) = delete;
+};
+
+// Suffix array over a read-only text: the start offsets of all suffixes in
+// sorted order, so the occurrences of any pattern form one range that binary
+// search finds in O(m log n). It is built by prefix doubling. Suffixes are
+// radix sorted on their first eight bytes, then every group that still ties
+// is re-sorted by the rank of the suffix h bytes further on, doubling h each
+// round. Radix passes are split over all cores and tied groups are sorted
+// in parallel. The array can be saved next to the file and mapped back in.
+class SuffixIndex
+{
+public:
+    explicit SuffixIndex(string_view text) : text(text), sa(nullptr), stored(nullptr) {}
+
+    // Index a private copy of the text
+    explicit SuffixIndex(string &&copy) : ownedText(move(copy)), sa(nullptr), stored(nullptr)
+    {
+        text = ownedText;
+    }
+
+    ~SuffixIndex()
+    {
+        delete stored;
+    }
+
+    // Offsets are stored in 32 bits
+    static bool fits(size_t size)
+    {
+        return size < UINT32_MAX;
+    }
+
+    static int threadCount()
+    {
+        return WorkPool::shared().threadCount();
+    }
+
+    size_t textSize() const
+    {
+        return text.size();
+    }
+
+    void build()
+    {
+        size_t n = text.size();
+        built.resize(n);
+        rank.assign(n, 0);
+        keys.assign(n, 0);
+        vector<Group> groups = sortByPrefix();
+        for (size_t h = 8; !groups.empty(); h *= 2)
+        {
+            groups = refine(groups, h);
+        }
+        rank = vector<uint32_t>();
+        keys = vector<uint32_t>();
+        sa = built.data();
+    }
+
+    // Number of (possibly overlapping) occurrences of `pattern`
+    size_t count(string_view pattern) const
+    {
+        auto found = range(pattern);
+        return found.second - found.first;
+    }
+
+    bool contains(string_view pattern) const
+    {
+        return count(pattern) > 0;
+    }
+
+    // Occurrences counted left to right without overlaps, as a scan would.
+    // Only a pattern whose prefix equals its suffix can overlap itself, so
+    // only those need their matches put in order.
+    size_t countNonOverlapping(string_view pattern) const
+    {
+        if (!selfOverlaps(pattern))
+        {
+            return count(pattern);
+        }
+        return positions(pattern).size();
+    }
+
+    // Offsets of the occurrences a left to right scan would find, in order
+    vector<uint32_t> positions(string_view pattern) const
+    {
+        auto found = range(pattern);
+        vector<uint32_t> starts(sa + found.first, sa + found.second);
+        sort(starts.begin(), starts.end());
+        size_t kept = 0;
+        size_t next = 0;
+        for (uint32_t start : starts)
+        {
+            if (start >= next)
+            {
+                starts[kept++] = start;
+                next = start + pattern.size();
+            }
+        }
+        starts.resize(kept);
+        return starts;
+    }
+
+    // Offset of the first occurrence in the text, or -1
+    long long first(string_view pattern) const
+    {
+        auto found = range(pattern);
+        if (found.first == found.second)
+        {
+            return -1;
+        }
+        return *min_element(sa + found.first, sa + found.second);
+    }
+
+    // Write the array next to the file it indexes, stamped with the file's
+    // size and modification time
+    bool save(const string &path, const struct stat &source) const
+    {
+        string tempName = path + ".saving";
+        ofstream out(tempName, ios::binary);
+        Header header = makeHeader(source);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(sa), text.size() * sizeof(uint32_t));
+        out.close();
+        if (!out)
+        {
+            remove(tempName.c_str());
+            return false;
+        }
+        return rename(tempName.c_str(), path.c_str()) == 0;
+    }
+
+    // Map a saved array back in; fails if it belongs to another version of
+    // the file
+    bool load(const string &path, const struct stat &source)
+    {
+        MappedFile *mapped = new MappedFile(path);
+        Header expected = makeHeader(source);
+        if (!mapped->isOpen() || mapped->size() != sizeof(Header) + text.size() * sizeof(uint32_t) ||
+            memcmp(mapped->data(), &expected, sizeof(Header)) != 0)
+        {
+            delete mapped;
+            return false;
+        }
+        delete stored;
+        stored = mapped;
+        sa = reinterpret_cast<const uint32_t *>(mapped->data() + sizeof(Header));
+        return true;
+    }
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint64_t textSize;
+        int64_t modifiedSeconds;
+        int64_t modifiedNanoseconds;
+    };
+
+    // A run of suffixes in `built` that tie on the bytes compared so far
+    struct Group
+    {
+        uint32_t start;
+        uint32_t length;
+    };
+
+    string_view text;
+    string ownedText;
+    vector<uint32_t> built;
+    const uint32_t *sa;  // `built`, or the array mapped from a saved index
+    MappedFile *stored;
+    vector<uint32_t> rank; // 1 + start of the suffix's group; 0 past the end
+    vector<uint32_t> keys; // Sort key of each slot during a round
+
+    Header makeHeader(const struct stat &source) const
+    {
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "TEXTSA1", 8);
+        header.textSize = text.size();
+        header.modifiedSeconds = source.st_mtim.tv_sec;
+        header.modifiedNanoseconds = source.st_mtim.tv_nsec;
+        return header;
+    }
+
+    unsigned char byteAt(size_t pos) const
+    {
+        return pos < text.size() ? text[pos] : 0;
+    }
+
+    // A byte shifted up by one, so the end of the text sorts before any byte
+    unsigned symbolAt(size_t pos) const
+    {
+        return pos < text.size() ? (unsigned char)text[pos] + 1 : 0;
+    }
+
+    // Two symbols of a suffix as one radix digit
+    unsigned digitAt(size_t pos) const
+    {
+        return symbolAt(pos) * 257 + symbolAt(pos + 1);
+    }
+
+    // First eight bytes of a suffix as a big-endian number, zero padded
+    uint64_t prefixKey(size_t pos) const
+    {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (pos + 8 <= text.size())
+        {
+            uint64_t word;
+            memcpy(&word, text.data() + pos, 8);
+            return __builtin_bswap64(word);
+        }
+#endif
+        uint64_t key = 0;
+        for (size_t i = 0; i < 8; ++i)
+        {
+            key = (key << 8) | byteAt(pos + i);
+        }
+        return key;
+    }
+
+    static bool selfOverlaps(string_view pattern)
+    {
+        for (size_t shift = 1; shift < pattern.size(); ++shift)
+        {
+            if (pattern.compare(shift, string_view::npos, pattern.substr(0, pattern.size() - shift)) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Stable counting sort of `from` into `to` by the two bytes `offset`
+    // bytes into each suffix, split over all cores
+    void radixPass(const vector<uint32_t> &from, vector<uint32_t> &to, size_t offset)
+    {
+        size_t n = from.size();
+        WorkPool &pool = WorkPool::shared();
+        int threads = pool.threadCount();
+        vector<vector<size_t>> slots(threads, vector<size_t>(257 * 257, 0));
+        pool.forEach(threads, [&](size_t t)
+                     {
+                         for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i)
+                         {
+                             slots[t][digitAt(from[i] + offset)]++;
+                         }
+                     });
+        size_t position = 0;
+        for (int value = 0; value < 257 * 257; ++value)
+        {
+            for (int t = 0; t < threads; ++t)
+            {
+                size_t counted = slots[t][value];
+                slots[t][value] = position; // Where thread t writes this value
+                position += counted;
+            }
+        }
+        pool.forEach(threads, [&](size_t t)
+                     {
+                         for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i)
+                         {
+                             to[slots[t][digitAt(from[i] + offset)]++] = from[i];
+                         }
+                     });
+    }
+
+    // Sort the suffixes on their first eight bytes, two bytes per pass from
+    // the last, and rank them. Returns the groups that still tie.
+    vector<Group> sortByPrefix()
+    {
+        size_t n = text.size();
+        for (size_t i = 0; i < n; ++i)
+        {
+            built[i] = i;
+        }
+        for (int offset = 6; offset >= 0; offset -= 2)
+        {
+            radixPass(built, keys, offset);
+            built.swap(keys);
+        }
+
+        vector<Group> groups;
+        size_t runStart = 0;
+        uint64_t runKey = 0;
+        size_t runLength = 0;
+        for (size_t j = 0; j <= n; ++j)
+        {
+            // Suffixes shorter than eight bytes only tie with themselves
+            uint64_t key = j < n ? prefixKey(built[j]) : 0;
+            size_t length = j < n ? min<size_t>(n - built[j], 8) : 0;
+            if (j == n || j == 0 || key != runKey || length != runLength)
+            {
+                if (j - runStart > 1)
+                {
+                    groups.push_back({(uint32_t)runStart, (uint32_t)(j - runStart)});
+                }
+                runStart = j;
+                runKey = key;
+                runLength = length;
+            }
+            if (j < n)
+            {
+                rank[built[j]] = runStart + 1;
+            }
+        }
+        return groups;
+    }
+
+    // Sort (rank << 32 | suffix) values by rank, a byte per pass
+    static void sortByRank(vector<uint64_t> &values, vector<uint64_t> &scratch)
+    {
+        scratch.resize(values.size());
+        for (int shift = 32; shift < 64; shift += 8)
+        {
+            size_t slots[257] = {0};
+            for (uint64_t value : values)
+            {
+                slots[((value >> shift) & 0xff) + 1]++;
+            }
+            for (int digit = 0; digit < 256; ++digit)
+            {
+                slots[digit + 1] += slots[digit];
+            }
+            for (uint64_t value : values)
+            {
+                scratch[slots[(value >> shift) & 0xff]++] = value;
+            }
+            values.swap(scratch);
+        }
+    }
+
+    // One doubling round: sort each tied group by the rank of the suffix
+    // `h` bytes on, then split it and re-rank. Ranks are only read while
+    // sorting and only written afterwards, so groups can run in parallel.
+    vector<Group> refine(const vector<Group> &groups, size_t h)
+    {
+        size_t n = text.size();
+        WorkPool &pool = WorkPool::shared();
+        pool.forEach(groups.size(), [&](size_t g)
+                     {
+                         Group group = groups[g];
+                         vector<uint64_t> sorted(group.length);
+                         vector<uint64_t> scratch;
+                         for (uint32_t j = 0; j < group.length; ++j)
+                         {
+                             uint32_t suffix = built[group.start + j];
+                             uint64_t key = suffix + h < n ? rank[suffix + h] : 0;
+                             sorted[j] = (key << 32) | suffix;
+                         }
+                         if (group.length > 1024)
+                         {
+                             sortByRank(sorted, scratch);
+                         }
+                         else
+                         {
+                             sort(sorted.begin(), sorted.end());
+                         }
+                         for (uint32_t j = 0; j < group.length; ++j)
+                         {
+                             built[group.start + j] = (uint32_t)sorted[j];
+                             keys[group.start + j] = sorted[j] >> 32;
+                         }
+                     });
+
+        vector<vector<Group>> found(groups.size() < 1024 ? 1 : 1024);
+        pool.forEach(found.size(), [&](size_t part)
+                     {
+                         size_t from = groups.size() * part / found.size();
+                         size_t to = groups.size() * (part + 1) / found.size();
+                         for (size_t g = from; g < to; ++g)
+                         {
+                             uint32_t start = groups[g].start;
+                             uint32_t end = start + groups[g].length;
+                             for (uint32_t j = start, runStart = start; j < end; ++j)
+                             {
+                                 if (keys[j] != keys[runStart])
+                                 {
+                                     runStart = j;
+                                 }
+                                 rank[built[j]] = runStart + 1;
+                                 if ((j + 1 == end || keys[j + 1] != keys[runStart]) && j > runStart)
+                                 {
+                                     found[part].push_back({runStart, j + 1 - runStart});
+                                 }
+                             }
+                         }
+                     });
+        vector<Group> next;
+        for (auto &part : found)
+        {
+            next.insert(next.end(), part.begin(), part.end());
+        }
+        return next;
+    }
+
+    // Compare the first pattern.size() bytes of a suffix with the pattern
+    int comparePrefix(uint32_t start, string_view pattern) const
+    {
+        size_t len = min(pattern.size(), text.size() - start);
+        int c = memcmp(text.data() + start, pattern.data(), len);
+        if (c != 0)
+        {
+            return c;
+        }
+        return len < pattern.size() ? -1 : 0;
+    }
+
+    // Slots [first, last) of the suffixes that start with `pattern`
+    pair<size_t, size_t> range(string_view pattern) const
+    {
+        size_t low = 0;
+        size_t high = text.size();
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            if (comparePrefix(sa[mid], pattern) < 0)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        size_t first = low;
+        high = text.size();
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            if (comparePrefix(sa[mid], pattern) <= 0)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        return {first, low};
+    }
+
+    SuffixIndex(const SuffixIndex &) = delete;
+    SuffixIndex &operator=(const SuffixIndex &) = delete;
+};
+
+// Replacements collected by a command and applied by Document::apply() in
+// one pass. Positions are in the line as it was when the edit was added, so
+// a command can scan a line and record every match before anything moves;
+// edits to one line must be added left to right and must not overlap.
+class EditBatch
+{
+public:
+    void add(int paraIndex, Line *line, int pos, int len, string_view text)
+    {
+        // Replace-all adds the same text over and over; store it once
+        if (edits.empty() || string_view(texts).substr(edits.back().textStart, edits.back().textLength) != text)
+        {
+            edits.push_back({paraIndex, line, pos, len, texts.size(), text.size()});
+            texts.append(text.data(), text.size());
+        }
+        else
+        {
+            edits.push_back({paraIndex, line, pos, len, edits.back().textStart, text.size()});
+        }
+    }
+
+    bool empty() const
+    {
+        return edits.empty();
+    }
+
+    int size() const
+    {
+        return edits.size();
+    }
+
+    void clear()
+    {
+        edits.clear();
+        texts.clear();
+    }
+
+private:
+    friend class Document;
+
+    struct Edit
+    {
+        int paraIndex;
+        Line *line;
+        int pos;
+        int len;
+        size_t textStart; // Replacement text, stored in `texts`
+        size_t textLength;
+    };
+
+    vector<Edit> edits;
+    string texts;
+};
+
+// Splits text into words without copying: each word is a string_view into
+// the text. What separates words is a class of bytes: Spaces splits at
+// whitespace only, as `>>` does, and NonAlnum keeps runs of letters and
+// digits, as the word under the cursor does. Bytes are classified with one
+// 256-entry table (C locale), which the statistics scan shares.
+class Tokenizer
+{
+public:
+    enum : unsigned char
+    {
+        Space = 1,
+        Alnum = 2,
+        SentenceEnd = 4 // . ! ?
+    };
+
+    enum Delimiters
+    {
+        Spaces,
+        NonAlnum
+    };
+
+    explicit Tokenizer(string_view text, Delimiters delimiters = Spaces)
+        : text(text), pos(0), mask(delimiters == Spaces ? Space : Alnum), inWord(delimiters != Spaces) {}
+
+    // The next word, or false at the end of the text
+    bool next(string_view &word)
+    {
+        while (pos < text.size() && !wordByte(text[pos]))
+        {
+            pos++;
+        }
+        size_t start = pos;
+        while (pos < text.size() && wordByte(text[pos]))
+        {
+            pos++;
+        }
+        word = text.substr(start, pos - start);
+        return pos > start;
+    }
+
+    // Call emit(word) for every word of `text`
+    template <class Emit>
+    static void forEach(string_view text, Delimiters delimiters, Emit emit)
+    {
+        Tokenizer words(text, delimiters);
+        string_view word;
+        while (words.next(word))
+        {
+            emit(word);
+        }
+    }
+
+    // Bounds [start, end) of the word touching column `col`; empty when
+    // there is none
+    static pair<int, int> wordAt(string_view text, int col, Delimiters delimiters)
+    {
+        Tokenizer words(text, delimiters);
+        int start = min(col, (int)text.size());
+        int end = start;
+        while (start > 0 && words.wordByte(text[start - 1]))
+        {
+            --start;
+        }
+        while (end < (int)text.size() && words.wordByte(text[end]))
+        {
+            ++end;
+        }
+        return {start, end};
+    }
+
+    static const unsigned char *classes()
+    {
+        static const array<unsigned char, 256> table = []
+        {
+            array<unsigned char, 256> table{};
+            for (int c = 0; c < 256; ++c)
+            {
+                table[c] = (isspace(c) ? Space : 0) | (isalnum(c) ? Alnum : 0) |
+                           (c == '.' || c == '!' || c == '?' ? SentenceEnd : 0);
+            }
+            return table;
+        }();
+        return table.data();
+    }
+
+private:
+    string_view text;
+    size_t pos;
+    unsigned char mask; // A byte is part of a word when its class has
+    bool inWord;        // `mask` set if inWord, or clear if not
+
+    bool wordByte(char c) const
+    {
+        return ((classes()[(unsigned char)c] & mask) != 0) == inWord;
+    }
+};
+
+// Optional inverted index from every word of a document (a run of non-space
+// characters, as read with `>>`) to the lines that contain it. The document
+// re-reads each line it edits and takes the line's old words out first, so
+// word counts and existence checks never have to scan the text.
+class WordIndex
+{
+public:
+    struct Word
+    {
+        string_view spelling;
+        long long count;            // Occurrences in the document
+        vector<const Line *> lines; // Lines containing the word, unordered
+        unsigned long long seenPass;
+        int seenAt;
+    };
+
+    WordIndex() : wordTotal(0), charTotal(0), distinct(0), pass(0) {}
+
+    // Size the line table up front when indexing a whole document
+    void reserve(int lines)
+    {
+        lineWords.reserve(lines);
+    }
+
+    // Add the words of a line that is not indexed yet
+    void addLine(Para *para, Line *line)
+    {
+        LineWords &entry = lineWords[line];
+        entry.para = para;
+        pass++;
+        Tokenizer::forEach(line->view(), Tokenizer::Spaces, [&](string_view text)
+                 {
+                     uint32_t id = idOf(text);
+                     Word &word = words[id];
+                     if (word.seenPass != pass)
+                     {
+                         word.seenPass = pass;
+                         word.seenAt = entry.words.size();
+                         entry.words.push_back({id, (uint32_t)word.lines.size(), 0});
+                         word.lines.push_back(line);
+                     }
+                     entry.words[word.seenAt].count++;
+                     if (word.count++ == 0)
+                     {
+                         distinct++;
+                     }
+                     wordTotal++;
+                     charTotal += text.size();
+                 });
+    }
+
+    // Take the words of a line out of the index
+    void removeLine(const Line *line)
+    {
+        auto found = lineWords.find(line);
+        if (found == lineWords.end())
+        {
+            return;
+        }
+        for (const auto &occurrence : found->second.words)
+        {
+            Word &word = words[occurrence.word];
+            word.count -= occurrence.count;
+            wordTotal -= occurrence.count;
+            charTotal -= (long long)occurrence.count * word.spelling.size();
+            if (word.count == 0)
+            {
+                distinct--;
+            }
+            // Swap the last line of the posting list into this one's slot
+            const Line *moved = word.lines.back();
+            word.lines[occurrence.slot] = moved;
+            word.lines.pop_back();
+            if (moved != line)
+            {
+                for (auto &other : lineWords[moved].words)
+                {
+                    if (other.word == occurrence.word)
+                    {
+                        other.slot = occurrence.slot;
+                        break;
+                    }
+                }
+            }
+        }
+        lineWords.erase(found);
+    }
+
+    void updateLine(Para *para, Line *line)
+    {
+        removeLine(line);
+        addLine(para, line);
+    }
+
+    // The word, or nullptr if it does not occur in the document
+    const Word *find(string_view text) const
+    {
+        auto found = ids.find(text);
+        if (found == ids.end() || words[found->second].count == 0)
+        {
+            return nullptr;
+        }
+        return &words[found->second];
+    }
+
+    long long count(string_view text) const
+    {
+        const Word *word = find(text);
+        return word == nullptr ? 0 : word->count;
+    }
+
+    // Whether `line` contains `word`
+    bool lineHas(const Line *line, const Word *word) const
+    {
+        auto found = lineWords.find(line);
+        if (found == lineWords.end())
+        {
+            return false;
+        }
+        for (const auto &occurrence : found->second.words)
+        {
+            if (&words[occurrence.word] == word)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Para *paraOf(const Line *line) const
+    {
+        auto found = lineWords.find(line);
+        return found == lineWords.end() ? nullptr : found->second.para;
+    }
+
+    long long totalWords() const
+    {
+        return wordTotal;
+    }
+
+    // Combined length of all words
+    long long totalChars() const
+    {
+        return charTotal;
+    }
+
+    int distinctWords() const
+    {
+        return distinct;
+    }
+
+    // Call visit(word) for every word that occurs in the document
+    template <class Visit>
+    void forEachWord(Visit visit) const
+    {
+        for (const auto &word : words)
+        {
+            if (word.count > 0)
+            {
+                visit(word);
+            }
+        }
+    }
+
+private:
+    // One distinct word of a line: how often it occurs there and where the
+    // line sits in the word's posting list
+    struct Occurrence
+    {
+        uint32_t word;
+        uint32_t slot;
+        uint32_t count;
+    };
+
+    struct LineWords
+    {
+        Para *para;
+        vector<Occurrence> words;
+    };
+
+    deque<string> spellings; // Key storage; deque never moves its elements
+    deque<Word> words;
+    unordered_map<string_view, uint32_t> ids;
+    unordered_map<const Line *, LineWords> lineWords;
+    long long wordTotal;
+    long long charTotal;
+    int distinct;
+    unsigned long long pass; // Tells addLine() which words it has seen
+
+    uint32_t idOf(string_view text)
+    {
+        auto found = ids.find(text);
+        if (found != ids.end())
+        {
+            return found->second;
+        }
+        spellings.emplace_back(text);
+        string_view key = spellings.back();
+        words.push_back({key, 0, {}, 0, 0});
+        ids.emplace(key, words.size() - 1);
+        return words.size() - 1;
+    }
+};
+
+// Undo/redo journal of a document. Every edit is logged as an operation
+// that can be replayed in either direction: a replacement (row, column,
+// removed text, inserted text), a line split or join, or a case conversion
+// of one line (its old text). Operations are grouped into steps, one per
+// command, and consecutive keystrokes in a line merge into one operation,
+// so undoing costs time in proportion to the change, not the document.
+//
+// Steps are stored encoded (varint positions, and replace-all's repeated
+// replacement text stored once per step). Once they take more than the
+// memory cap, the oldest steps, and the open step while a command keeps
+// adding to it, are moved to an unlinked temporary file. Steps [0, cursor)
+// can be undone and [cursor, end) redone; a new step drops the redo part.
+class UndoLog
+{
+public:
+    struct Op
+    {
+        char kind; // 'r' replace, 's' split, 'j' join, 'U' / 'L' to upper / lower case
+        int row;
+        int col;
+        int paraBreak; // Split and join: see Document::splitLine()
+        string_view removed;
+        string_view inserted;
+    };
+
+    explicit UndoLog(size_t memoryCap = 16 << 20)
+        : memoryCap(memoryCap), memoryBytes(0), cursor(0), spilled(0), spillFd(-1), fileBytes(0),
+          openOffset(-1), openSpilled(0), pending(false) {}
+
+    ~UndoLog()
+    {
+        if (spillFd >= 0)
+        {
+            close(spillFd);
+        }
+    }
+
+    void setMemoryCap(size_t bytes)
+    {
+        memoryCap = bytes;
+        spill();
+    }
+
+    void replaced(int row, int col, string_view removed, string_view inserted)
+    {
+        if (pending && last.kind == 'r' && last.row == row)
+        {
+            if (removed.empty() && lastRemoved.empty() && col == last.col + (int)lastInserted.size())
+            {
+                lastInserted.append(inserted); // Typing
+                return;
+            }
+            if (inserted.empty() && lastInserted.empty() && col + (int)removed.size() == last.col)
+            {
+                lastRemoved.insert(0, removed); // Backspace
+                last.col = col;
+                return;
+            }
+            if (inserted.empty() && lastInserted.empty() && col == last.col)
+            {
+                lastRemoved.append(removed); // Delete
+                return;
+            }
+        }
+        add({'r', row, col, 0, {}, {}}, removed, inserted);
+    }
+
+    void split(int row, int col, int paraBreak)
+    {
+        add({'s', row, col, paraBreak, {}, {}}, {}, {});
+    }
+
+    void joined(int row, int col, int paraBreak)
+    {
+        add({'j', row, col, paraBreak, {}, {}}, {}, {});
+    }
+
+    void converted(int row, bool upper, string_view old)
+    {
+        add({upper ? 'U' : 'L', row, 0, 0, {}, {}}, old, {});
+    }
+
+    // End the current step; the next operation starts a new one
+    void closeStep()
+    {
+        flushPending();
+        if (openOffset < 0 && open.empty())
+        {
+            return;
+        }
+        Step step;
+        if (openOffset >= 0)
+        {
+            writeSpill(open);
+            step = {openOffset, openSpilled + open.size(), string()};
+            open.clear();
+        }
+        else
+        {
+            step = {-1, open.size(), move(open)};
+            memoryBytes += step.size;
+            open = string();
+        }
+        steps.push_back(move(step));
+        cursor = steps.size();
+        if (openOffset >= 0)
+        {
+            spilled = steps.size(); // Every earlier step went out first
+        }
+        openOffset = -1;
+        openSpilled = 0;
+        spill();
+    }
+
+    // Take the step to undo, or return false when there is none
+    bool undo(string &step)
+    {
+        closeStep();
+        if (cursor == 0 || !read(steps[cursor - 1], step))
+        {
+            return false;
+        }
+        cursor--;
+        return true;
+    }
+
+    bool redo(string &step)
+    {
+        closeStep();
+        if (cursor == steps.size() || !read(steps[cursor], step))
+        {
+            return false;
+        }
+        cursor++;
+        return true;
+    }
+
+    int undoCount() const
+    {
+        return cursor;
+    }
+
+    int redoCount() const
+    {
+        return steps.size() - cursor;
+    }
+
+    size_t memoryUsed() const
+    {
+        return memoryBytes + open.size();
+    }
+
+    long long diskUsed() const
+    {
+        return fileBytes;
+    }
+
+    // Call visit(op) for every operation of a step, in the order they were
+    // made or in reverse; the views in an Op point into `step`. Going
+    // backwards decodes a block of operations at a time, so even a
+    // replace-all step is never expanded all at once.
+    template <class Visit>
+    static void forEachOp(const string &step, bool reverse, Visit visit)
+    {
+        Cursor at = {0, string_view()};
+        if (!reverse)
+        {
+            while (at.pos < step.size())
+            {
+                visit(next(step, at));
+            }
+            return;
+        }
+        const size_t Block = 4096;
+        vector<Cursor> marks; // Where each block starts
+        for (size_t count = 0; at.pos < step.size(); ++count)
+        {
+            if (count % Block == 0)
+            {
+                marks.push_back(at);
+            }
+            next(step, at);
+        }
+        vector<Op> ops;
+        for (size_t m = marks.size(); m-- > 0;)
+        {
+            size_t end = m + 1 < marks.size() ? marks[m + 1].pos : step.size();
+            ops.clear();
+            for (at = marks[m]; at.pos < end;)
+            {
+                ops.push_back(next(step, at));
+            }
+            for (size_t i = ops.size(); i-- > 0;)
+            {
+                visit(ops[i]);
+            }
+        }
+    }
+
+private:
+    struct Cursor
+    {
+        size_t pos;
+        string_view previous; // Inserted text of the last replacement read
+    };
+
+    struct Step
+    {
+        long long offset; // In the spill file, or -1 while `bytes` holds it
+        size_t size;
+        string bytes;
+    };
+
+    size_t memoryCap;
+    size_t memoryBytes; // Closed steps held in memory
+    vector<Step> steps;
+    size_t cursor;
+    size_t spilled; // steps[0, spilled) are in the spill file
+    int spillFd;
+    long long fileBytes;
+
+    string open;            // Encoded operations of the open step
+    long long openOffset;   // Where the open step starts in the spill file, or -1
+    size_t openSpilled;     // Bytes of it already written there
+    string previousInserted; // Last inserted text encoded in the open step
+
+    // The last operation stays decoded until the next one, so keystrokes
+    // can merge into it
+    bool pending;
+    Op last;
+    string lastRemoved;
+    string lastInserted;
+
+    void add(const Op &op, string_view removed, string_view inserted)
+    {
+        flushPending();
+        if (openOffset < 0 && open.empty())
+        {
+            dropRedo();
+            previousInserted.clear();
+        }
+        pending = true;
+        last = op;
+        lastRemoved.assign(removed);
+        lastInserted.assign(inserted);
+    }
+
+    void flushPending()
+    {
+        if (!pending)
+        {
+            return;
+        }
+        pending = false;
+        bool repeated = last.kind == 'r' && !lastInserted.empty() && lastInserted == previousInserted;
+        open += repeated ? 'R' : last.kind;
+        writeNumber(open, last.row);
+        writeNumber(open, last.col);
+        if (last.kind == 's' || last.kind == 'j')
+        {
+            open += (char)last.paraBreak;
+        }
+        if (last.kind == 'r' || last.kind == 'U' || last.kind == 'L')
+        {
+            writeNumber(open, lastRemoved.size());
+            open += lastRemoved;
+        }
+        if (last.kind == 'r' && !repeated)
+        {
+            writeNumber(open, lastInserted.size());
+            open += lastInserted;
+            previousInserted.swap(lastInserted);
+        }
+        if (memoryUsed() > memoryCap)
+        {
+            spill();
+        }
+    }
+
+    // Forget the steps that were undone
+    void dropRedo()
+    {
+        for (size_t i = cursor; i < steps.size(); ++i)
+        {
+            memoryBytes -= steps[i].offset < 0 ? steps[i].size : 0;
+        }
+        if (spilled > cursor)
+        {
+            fileBytes = steps[cursor].offset;
+            if (ftruncate(spillFd, fileBytes) != 0)
+            {
+                // The space is reused by the next write either way
+            }
+            spilled = cursor;
+        }
+        steps.resize(cursor);
+    }
+
+    // Move the oldest steps to disk until memory use is under the cap. A
+    // single step bigger than the cap goes out as it is being recorded.
+    void spill()
+    {
+        while (memoryUsed() > memoryCap && spilled < steps.size() && openSpillFile())
+        {
+            Step &step = steps[spilled];
+            if (step.offset < 0)
+            {
+                step.offset = fileBytes;
+                if (!writeSpill(step.bytes))
+                {
+                    step.offset = -1;
+                    return;
+                }
+                memoryBytes -= step.size;
+                step.bytes = string();
+            }
+            spilled++;
+        }
+        if (memoryUsed() > memoryCap && spilled == steps.size() && !open.empty() && openSpillFile())
+        {
+            long long offset = fileBytes;
+            if (writeSpill(open))
+            {
+                openOffset = openOffset < 0 ? offset : openOffset;
+                openSpilled += open.size();
+                open.clear();
+            }
+        }
+    }
+
+    bool openSpillFile()
+    {
+        if (spillFd < 0)
+        {
+            char name[] = "/tmp/text-undo-XXXXXX";
+            spillFd = mkstemp(name);
+            if (spillFd >= 0)
+            {
+                unlink(name); // Gone when the editor exits
+            }
+        }
+        return spillFd >= 0;
+    }
+
+    bool writeSpill(const string &bytes)
+    {
+        for (size_t written = 0; written < bytes.size();)
+        {
+            ssize_t count = pwrite(spillFd, bytes.data() + written, bytes.size() - written, fileBytes);
+            if (count < 0 && errno != EINTR)
+            {
+                return false;
+            }
+            written += max<ssize_t>(count, 0);
+            fileBytes += max<ssize_t>(count, 0);
+        }
+        return true;
+    }
+
+    bool read(const Step &step, string &bytes)
+    {
+        if (step.offset < 0)
+        {
+            bytes = step.bytes;
+            return true;
+        }
+        bytes.resize(step.size);
+        for (size_t done = 0; done < step.size;)
+        {
+            ssize_t count = pread(spillFd, &bytes[done], step.size - done, step.offset + done);
+            if (count == 0 || (count < 0 && errno != EINTR))
+            {
+                return false; // The file ends before the step does, or cannot be read
+            }
+            done += max<ssize_t>(count, 0);
+        }
+        return true;
+    }
+
+    static Op next(const string &step, Cursor &at)
+    {
+        const char *pos = step.data() + at.pos;
+        Op op = {*pos++, 0, 0, 0, {}, {}};
+        op.row = readNumber(pos);
+        op.col = readNumber(pos);
+        if (op.kind == 's' || op.kind == 'j')
+        {
+            op.paraBreak = *pos++;
+        }
+        if (op.kind == 'r' || op.kind == 'R' || op.kind == 'U' || op.kind == 'L')
+        {
+            size_t len = readNumber(pos);
+            op.removed = string_view(pos, len);
+            pos += len;
+        }
+        if (op.kind == 'r')
+        {
+            size_t len = readNumber(pos);
+            op.inserted = at.previous = string_view(pos, len);
+            pos += len;
+        }
+        else if (op.kind == 'R')
+        {
+            op.kind = 'r';
+            op.inserted = at.previous;
+        }
+        at.pos = pos - step.data();
+        return op;
+    }
+
+    static void writeNumber(string &out, size_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+        {
+            out += (char)(value | 0x80);
+        }
+        out += (char)value;
+    }
+
+    static size_t readNumber(const char *&pos)
+    {
+        size_t value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            unsigned char byte = *pos++;
+            value |= (size_t)(byte & 0x7f) << shift;
+            if (byte < 0x80)
+            {
+                return value;
+            }
+        }
+    }
+
+    UndoLog(const UndoLog &) = delete;
+    UndoLog &operator=(const UndoLog &) = delete;
+};
+
+// The counters behind the statistics commands, all gathered in one pass
+// over each line. Bytes are classified with the Tokenizer's table rather
+// than isalnum/isspace calls. Words are runs of non-space bytes, as read with
+// `>>`; special characters are neither letters, digits nor spaces. The
+// counts of consecutive runs of lines are combined with merge().
+struct TextStats
+{
+    long long lines;
+    long long blankLines;
+    long long chars; // Not counting newlines
+    long long words;
+    long long wordChars;
+    long long special;
+    long long sentences;
+    int paragraphs;
+    int textParagraphs; // Paragraphs with at least one non-empty line
+    int shortestWord;   // INT_MAX while there are no words
+    int longestWord;
+
+    // First and last paragraph seen and whether each had text, so a
+    // paragraph split between two merged runs is counted once
+    int firstPara;
+    int lastPara;
+    bool firstHadText;
+    bool lastHadText;
+
+    TextStats()
+        : lines(0), blankLines(0), chars(0), words(0), wordChars(0), special(0), sentences(0), paragraphs(0),
+          textParagraphs(0), shortestWord(INT_MAX), longestWord(0), firstPara(-1), lastPara(-1),
+          firstHadText(false), lastHadText(false) {}
+
+    void addLine(int para, string_view text)
+    {
+        if (para != lastPara)
+        {
+            firstPara = firstPara < 0 ? para : firstPara;
+            lastPara = para;
+            lastHadText = false;
+            paragraphs++;
+        }
+        if (!text.empty() && !lastHadText)
+        {
+            lastHadText = true;
+            firstHadText = firstHadText || para == firstPara;
+            textParagraphs++;
+        }
+        countLine(text, 1);
+    }
+
+    // Add (sign 1) or take back (sign -1) the counts of one line. Word
+    // lengths and paragraphs cannot be taken back, so the live totals of
+    // an edited document only keep the counters this changes.
+    void countLine(string_view text, int sign)
+    {
+        lines += sign;
+        blankLines += sign * text.empty();
+        countText(text, sign);
+    }
+
+    // Same for the characters, words and sentences of part of a line that
+    // starts and ends at a space or the end of the line
+    void countText(string_view text, int sign)
+    {
+        chars += sign * (long long)text.size();
+
+        const unsigned char *table = Tokenizer::classes();
+        long long lineWords = 0;
+        long long lineSpecial = 0;
+        long long lineSentences = 0;
+        int wordLength = 0;
+        for (unsigned char c : text)
+        {
+            unsigned char kind = table[c];
+            if (kind & Tokenizer::Space)
+            {
+                if (wordLength > 0)
+                {
+                    addWord(wordLength, sign);
+                    lineWords++;
+                    wordLength = 0;
+                }
+                continue;
+            }
+            wordLength++;
+            lineSpecial += !(kind & Tokenizer::Alnum);
+            lineSentences += (kind & Tokenizer::SentenceEnd) != 0;
+        }
+        if (wordLength > 0)
+        {
+            addWord(wordLength, sign);
+            lineWords++;
+        }
+        words += sign * lineWords;
+        special += sign * lineSpecial;
+        sentences += sign * lineSentences;
+    }
+
+    // Add the counts of the lines that follow these
+    void merge(const TextStats &next)
+    {
+        if (next.lines == 0)
+        {
+            return;
+        }
+        if (lines == 0)
+        {
+            *this = next;
+            return;
+        }
+        lines += next.lines;
+        blankLines += next.blankLines;
+        chars += next.chars;
+        words += next.words;
+        wordChars += next.wordChars;
+        special += next.special;
+        sentences += next.sentences;
+        shortestWord = min(shortestWord, next.shortestWord);
+        longestWord = max(longestWord, next.longestWord);
+        paragraphs += next.paragraphs;
+        textParagraphs += next.textParagraphs;
+        if (next.firstPara == lastPara)
+        {
+            paragraphs--;
+            textParagraphs -= lastHadText && next.firstHadText;
+            if (firstPara == lastPara)
+            {
+                firstHadText = firstHadText || next.firstHadText;
+            }
+            lastHadText = next.firstPara == next.lastPara ? lastHadText || next.lastHadText : next.lastHadText;
+        }
+        else
+        {
+            lastHadText = next.lastHadText;
+        }
+        lastPara = next.lastPara;
+    }
+
+private:
+    void addWord(int length, int sign)
+    {
+        wordChars += sign * length;
+        if (sign > 0)
+        {
+            shortestWord = min(shortestWord, length);
+            longestWord = max(longestWord, length);
+        }
+    }
+};
+
+// Occurrences of every word, in an open-addressing table with linear
+// probing. Keys are views into the counted text, so counting a word that is
+// already there allocates nothing; the text must outlive the table. Entries
+// keep their hash, so growing and merging tables never hash a word again.
+class WordCounts
+{
+public:
+    struct Entry
+    {
+        string_view word;
+        size_t hash;
+        long long count; // 0 marks an empty slot
+    };
+
+    WordCounts() : slots(16), used(0), wordTotal(0) {}
+
+    void add(string_view word)
+    {
+        add(word, hash<string_view>()(word), 1);
+    }
+
+    void add(string_view word, size_t wordHash, long long count)
+    {
+        if ((used + 1) * 2 > slots.size())
+        {
+            grow();
+        }
+        size_t mask = slots.size() - 1;
+        size_t i = wordHash & mask;
+        while (slots[i].count != 0)
+        {
+            if (slots[i].hash == wordHash && slots[i].word == word)
+            {
+                slots[i].count += count;
+                wordTotal += count;
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+        slots[i] = {word, wordHash, count};
+        used++;
+        wordTotal += count;
+    }
+
+    // Distinct words
+    size_t size() const
+    {
+        return used;
+    }
+
+    long long total() const
+    {
+        return wordTotal;
+    }
+
+    template <class Visit>
+    void forEach(Visit visit) const
+    {
+        for (const Entry &entry : slots)
+        {
+            if (entry.count != 0)
+            {
+                visit(entry);
+            }
+        }
+    }
+
+    // Add the words of `other` that belong to shard `shard` of `shards`
+    void mergeShard(const WordCounts &other, size_t shard, size_t shards)
+    {
+        other.forEach([&](const Entry &entry)
+                      {
+                          if (shardOf(entry.hash, shards) == shard)
+                          {
+                              add(entry.word, entry.hash, entry.count);
+                          }
+                      });
+    }
+
+    // Shards are picked by the high half of the hash; slots use the low bits
+    static size_t shardOf(size_t wordHash, size_t shards)
+    {
+        return (wordHash >> (sizeof(size_t) * 4)) % shards;
+    }
+
+    // The k most frequent words of all `tables`, most frequent first and
+    // ties in byte order. Only a heap of the best k so far is kept, with
+    // the worst of them on top, so this is O(n log k).
+    static vector<Entry> top(const vector<WordCounts> &tables, size_t k)
+    {
+        auto better = [](const Entry &a, const Entry &b)
+        { return a.count != b.count ? a.count > b.count : a.word < b.word; };
+        vector<Entry> heap;
+        if (k == 0)
+        {
+            return heap;
+        }
+        for (const WordCounts &table : tables)
+        {
+            table.forEach([&](const Entry &entry)
+                          {
+                              if (heap.size() < k)
+                              {
+                                  heap.push_back(entry);
+                                  push_heap(heap.begin(), heap.end(), better);
+                              }
+                              else if (better(entry, heap.front()))
+                              {
+                                  pop_heap(heap.begin(), heap.end(), better);
+                                  heap.back() = entry;
+                                  push_heap(heap.begin(), heap.end(), better);
+                              }
+                          });
+        }
+        sort_heap(heap.begin(), heap.end(), better);
+        return heap;
+    }
+
+private:
+    vector<Entry> slots; // Power of two in size, at most half full
+    size_t used;
+    long long wordTotal;
+
+    void grow()
+    {
+        vector<Entry> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Entry &entry : old)
+        {
+            if (entry.count != 0)
+            {
+                size_t i = entry.hash & mask;
+                while (slots[i].count != 0)
+                {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = entry;
+            }
+        }
+    }
+};
+
+// Rows are numbered across the whole document and offsets count one
+// newline after every line. Lines and paragraphs are allocated from the
+// document's NodePool and must be created and freed through it, and lines
+// must be edited through it while the word index is on. The Fenwick
+// indexes over paragraph line counts and spans (characters plus newlines)
+// make row and offset lookups O(log n); lineCounts/spanCounts remember what
+// is currently indexed so a paragraph can be refreshed with a single delta.
+class Document
+{
+public:
+    vector<Para *> paragraphs;
+    MappedFile *source; // File the unedited lines point into, if any
+    WordIndex *words;   // Set while the word index is turned on
+    string fileName;    // File the document was loaded from, if any
+    UndoLog history;    // Every edit made through the document
+    TextStats *live;    // Running totals for the status line, while turned on
+
+    Document()
+        : source(nullptr), words(nullptr), live(nullptr), suffixes(nullptr), editsAtStart(Line::edits),
+          replaying(false), rankedAt(0), rankedLines(-1) {}
+
+    Line *newLine()
+    {
+        return pool.create<Line>();
+    }
+
+    Line *newLine(const char *text, size_t len)
+    {
+        return pool.create<Line>(text, len);
+    }
+
+    Para *newPara()
+    {
+        return pool.create<Para>();
+    }
+
+    void freeLine(Line *line)
+    {
+        if (words != nullptr)
+        {
+            words->removeLine(line);
+        }
+        pool.destroy(line);
+    }
+
+    // Build the word index over the current text, or drop it
+    void enableWordIndex(bool enable)
+    {
+        delete words;
+        words = nullptr;
+        if (enable)
+        {
+            words = new WordIndex();
+            words->reserve(lineCount());
+            for (auto para : paragraphs)
+            {
+                for (auto line : para->lines)
+                {
+                    words->addLine(para, line);
+                }
+            }
+        }
+    }
+
+    // Count the whole text once, then keep the totals up to date: every
+    // edit takes the old counts of the lines it touches out and adds the
+    // new ones, so the status line costs the same for any document size
+    void enableLiveStats(bool enable)
+    {
+        delete live;
+        live = enable ? new TextStats(statistics()) : nullptr;
+    }
+
+    // True while no line has been edited, so the text is still the file
+    bool unedited() const
+    {
+        return Line::edits == editsAtStart;
+    }
+
+    // The suffix index (F11), or null when there is none or the text has
+    // changed since it was built
+    SuffixIndex *currentSuffixes()
+    {
+        if (suffixes != nullptr && suffixesAt != Line::edits)
+        {
+            setSuffixes(nullptr);
+        }
+        return suffixes;
+    }
+
+    void setSuffixes(SuffixIndex *index)
+    {
+        delete suffixes;
+        suffixes = index;
+        suffixesAt = Line::edits;
+    }
+
+    // The text with every line followed by '\n', so offsets into it are
+    // document offsets
+    string textCopy()
+    {
+        string text;
+        text.reserve(spanCount());
+        for (auto para : paragraphs)
+        {
+            for (auto line : para->lines)
+            {
+                text += line->view();
+                text += '\n';
+            }
+        }
+        return text;
+    }
+
+    size_t arenaBytesInUse() const
+    {
+        return pool.bytesInUse();
+    }
+
+    size_t arenaBytesReserved() const
+    {
+        return pool.bytesReserved();
+    }
+
+    // Keep the mapping alive for as long as lines may reference it
+    void attachSource(MappedFile *mapped)
+    {
+        delete source;
+        source = mapped;
+    }
+
+    void addParagraph(Para *para)
+    {
+        paraIndexes[para] = paragraphs.size();
+        paragraphs.push_back(para);
+        lineCounts.push_back(para->lineCount());
+        spanCounts.push_back(spanOf(para));
+        lineIndex.push_back(lineCounts.back());
+        spanIndex.push_back(spanCounts.back());
+    }
+
+    // Append loaded lines to a paragraph (its counts are refreshed by the
+    // caller)
+    void addLines(Para *para, const vector<Line *> &batch)
+    {
+        para->addLines(batch);
+        if (words != nullptr)
+        {
+            for (auto line : batch)
+            {
+                words->addLine(para, line);
+            }
+        }
+        if (live != nullptr)
+        {
+            for (auto line : batch)
+            {
+                live->countLine(line->view(), 1);
+            }
+        }
+    }
+
+    int lineCount() const
+    {
+        return lineIndex.total();
+    }
+
+    // Characters plus one newline per line
+    long long spanCount() const
+    {
+        return spanIndex.total();
+    }
+
+    // A run of consecutive lines of one paragraph: the unit of work when a
+    // whole-document command is spread over the WorkPool
+    struct LineChunk
+    {
+        int para;
+        int firstRow; // Document row of `first`
+        Line *first;
+        int count;
+
+        // Call visit(row, line) for each line of the chunk
+        template <class Visit>
+        void forEach(Visit visit) const
+        {
+            LineTree::iterator it(first);
+            for (int i = 0; i < count; ++i, ++it)
+            {
+                visit(firstRow + i, *it);
+            }
+        }
+    };
+
+    vector<LineChunk> lineChunks() const
+    {
+        const int ChunkLines = 2048;
+        vector<LineChunk> chunks;
+        int row = 0;
+        for (int p = 0; p < paraCount(); ++p)
+        {
+            Para *para = paragraphs[p];
+            int lines = para->lineCount();
+            for (int first = 0; first < lines; first += ChunkLines)
+            {
+                chunks.push_back({p, row + first, para->lines.at(first), min(ChunkLines, lines - first)});
+            }
+            row += lines;
+        }
+        return chunks;
+    }
+
+    // Run scan(chunk) for every chunk on the WorkPool. Each line belongs to
+    // one chunk, so a scan may edit its lines in place but must not change
+    // their length or the tree.
+    template <class Scan>
+    void forEachChunk(Scan scan)
+    {
+        vector<LineChunk> chunks = lineChunks();
+        WorkPool::shared().forEach(chunks.size(), [&](size_t i)
+                                   { scan(chunks[i]); });
+    }
+
+    // Same, folding what each chunk returns into `initial` with combine()
+    // in document order
+    template <class T, class Scan, class Combine>
+    T reduceLines(T initial, Scan scan, Combine combine)
+    {
+        vector<LineChunk> chunks = lineChunks();
+        return WorkPool::shared().reduce(chunks.size(), move(initial), [&](size_t i)
+                                         { return scan(chunks[i]); }, combine);
+    }
+
+    // Re-read the counts of one paragraph after its lines were edited
+    void refreshPara(int index)
+    {
+        Para *para = paragraphs[index];
+        int lines = para->lineCount();
+        long long span = spanOf(para);
+        lineIndex.add(index, lines - lineCounts[index]);
+        spanIndex.add(index, span - spanCounts[index]);
+        lineCounts[index] = lines;
+        spanCounts[index] = span;
+    }
+
+    // Find the paragraph holding a document row and the row inside it
+    bool locateRow(int row, int &paraIndex, int &localRow) const
+    {
+        if (row < 0)
+        {
+            return false;
+        }
+        long long target = row;
+        paraIndex = lineIndex.find(target);
+        localRow = target;
+        return paraIndex < paraCount();
+    }
+
+    // Map a document offset to a row and column
+    bool locate(long long offset, int &row, int &col) const
+    {
+        if (offset < 0)
+        {
+            return false;
+        }
+        long long target = offset;
+        int paraIndex = spanIndex.find(target);
+        if (paraIndex >= paraCount())
+        {
+            return false;
+        }
+        if (!paragraphs[paraIndex]->lines.locate(target, row, col))
+        {
+            return false;
+        }
+        row += lineIndex.prefix(paraIndex);
+        return true;
+    }
+
+    // Offset of the first character of a row
+    long long offsetOf(int row) const
+    {
+        int paraIndex, localRow;
+        if (!locateRow(row, paraIndex, localRow))
+        {
+            return spanIndex.total();
+        }
+        return spanIndex.prefix(paraIndex) + paragraphs[paraIndex]->lines.offsetOf(localRow);
+    }
+
+    // Break a row in two at `col` (Enter). The tail stays in the row's
+    // paragraph unless `paraBreak` is 1, which makes it the first line of
+    // the next paragraph, or 2, which makes it a paragraph of its own; both
+    // undo a join across paragraphs and need the row to end its paragraph.
+    void splitLine(int row, int col, int paraBreak = 0)
+    {
+        int paraIndex, localRow;
+        if (!locateRow(row, paraIndex, localRow))
+        {
+            return;
+        }
+        if (!replaying)
+        {
+            history.split(row, col, paraBreak);
+        }
+        Para *para = paragraphs[paraIndex];
+        Line *head = para->getLine(localRow);
+        Line *tail = newLine();
+        uncount(head);
+        head->moveTailTo(col, tail);
+        count(head);
+        count(tail);
+        Para *tailPara = para;
+        if (paraBreak == 0)
+        {
+            para->insertLine(localRow + 1, tail);
+            refreshPara(paraIndex);
+        }
+        else if (paraBreak == 1)
+        {
+            tailPara = paragraphs[paraIndex + 1];
+            tailPara->insertLine(0, tail);
+            refreshPara(paraIndex);
+            refreshPara(paraIndex + 1);
+        }
+        else
+        {
+            tailPara = newPara();
+            tailPara->addLine(tail);
+            paragraphs.insert(paragraphs.begin() + paraIndex + 1, tailPara);
+            rebuildIndex();
+        }
+        if (words != nullptr)
+        {
+            words->updateLine(para, head);
+            words->addLine(tailPara, tail);
+        }
+    }
+
+    // Append a row to the one above it and delete it. Returns the column
+    // where the joined text starts, or -1 when there is no row above.
+    int joinWithPrevious(int row)
+    {
+        int paraIndex, localRow;
+        if (row <= 0 || !locateRow(row, paraIndex, localRow))
+        {
+            return -1;
+        }
+        Para *para = paragraphs[paraIndex];
+        Para *prevPara = localRow > 0 ? para : paragraphs[paraIndex - 1];
+        Line *prevLine = getLine(row - 1);
+        int prevLength = prevLine->length();
+        if (!replaying)
+        {
+            history.joined(row, prevLength, localRow > 0 ? 0 : para->lineCount() == 1 ? 2 : 1);
+        }
+        uncount(prevLine);
+        uncount(para->getLine(localRow));
+        prevLine->append(*para->getLine(localRow));
+        count(prevLine);
+        freeLine(para->removeLine(localRow));
+        if (words != nullptr)
+        {
+            words->updateLine(prevPara, prevLine);
+        }
+
+        if (para->lineCount() == 0)
+        {
+            pool.destroy(para);
+            paragraphs.erase(paragraphs.begin() + paraIndex);
+            rebuildIndex();
+        }
+        else
+        {
+            refreshPara(paraIndex);
+            if (localRow == 0)
+            {
+                refreshPara(paraIndex - 1);
+            }
+        }
+        return prevLength;
+    }
+
+    // Apply a batch of replacements. Each line is edited left to right, its
+    // tree counts are updated once, and every touched paragraph is
+    // re-indexed once at the end.
+    void apply(const EditBatch &batch)
+    {
+        string_view texts = batch.texts;
+        vector<int> touched;
+        size_t i = 0;
+        while (i < batch.edits.size())
+        {
+            Line *line = batch.edits[i].line;
+            size_t first = i;
+            long long growth = 0;
+            for (; i < batch.edits.size() && batch.edits[i].line == line; ++i)
+            {
+                growth += (long long)batch.edits[i].textLength - batch.edits[i].len;
+            }
+            line->reserve(max(growth, 0LL));
+            if (!replaying)
+            {
+                record(batch, first, i);
+            }
+            uncount(line);
+
+            long long shift = 0; // How far earlier edits moved this line
+            for (i = first; i < batch.edits.size() && batch.edits[i].line == line; ++i)
+            {
+                const auto &edit = batch.edits[i];
+                shift += line->splice(edit.pos + shift, edit.len, texts.substr(edit.textStart, edit.textLength));
+            }
+            line->lengthChanged(shift);
+            count(line);
+            int paraIndex = batch.edits[i - 1].paraIndex;
+            if (words != nullptr)
+            {
+                words->updateLine(paragraphs[paraIndex], line);
+            }
+            if (touched.empty() || touched.back() != paraIndex)
+            {
+                touched.push_back(paraIndex);
+            }
+        }
+        for (int paraIndex : touched)
+        {
+            refreshPara(paraIndex);
+        }
+    }
+
+    // Replace `len` characters of a row with `text`
+    void replaceAt(int row, int col, int len, string_view text)
+    {
+        int paraIndex, localRow;
+        if (!locateRow(row, paraIndex, localRow))
+        {
+            return;
+        }
+        Para *para = paragraphs[paraIndex];
+        Line *line = para->getLine(localRow);
+        if (!replaying)
+        {
+            history.replaced(row, col, line->substr(col, len), text);
+        }
+        countAround(line, col, len, -1);
+        line->replaceRange(col, len, text);
+        countAround(line, col, text.size(), 1);
+        refreshPara(paraIndex);
+        if (words != nullptr)
+        {
+            words->updateLine(para, line);
+        }
+    }
+
+    // Undo the last step, leaving `row` and `col` where it changed the text
+    bool undo(int &row, int &col)
+    {
+        return replay(false, row, col);
+    }
+
+    bool redo(int &row, int &col)
+    {
+        return replay(true, row, col);
+    }
+
+    int paraCount() const
+    {
+        return paragraphs.size();
+    }
+    Para *getPara(int index)
+    {
+        if (index < 0 || index >= paraCount())
+        {
+            return nullptr; // Check if index is out of bounds
+        }
+        return paragraphs[index];
+    }
+
+    // The document is written to a temporary file that is then renamed over
+    // the target, so saving over the mapped source never truncates the pages
+    // that unedited lines still point into.
+    void saveToFile(const string &filename)
+    {
+        string tempName = filename + ".saving";
+        ofstream file(tempName);
+        for (auto para : paragraphs)
+        {
+            for (auto line : para->lines)
+            {
+                line->writeTo(file);
+                file << '\n';
+            }
+            file << '\n';
+        }
+        file.close();
+        replaceFile(tempName, filename);
+    }
+
+    // Move a finished temporary file over `path`, keeping the permissions of
+    // the file it replaces. Unedited lines point into a mapping of the file
+    // that was opened, so it must be replaced and never truncated in place.
+    static bool replaceFile(const string &tempName, const string &path)
+    {
+        struct stat fileStat;
+        if (stat(path.c_str(), &fileStat) == 0)
+        {
+            chmod(tempName.c_str(), fileStat.st_mode & 07777);
+        }
+        if (rename(tempName.c_str(), path.c_str()) != 0)
+        {
+            remove(tempName.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    Line *getLine(int index)
+    {
+        int paraIndex, localRow;
+        if (!locateRow(index, paraIndex, localRow))
+        {
+            return nullptr; // If no line is found
+        }
+        return paragraphs[paraIndex]->getLine(localRow);
+    }
+
+    // Only edited lines own heap buffers; the nodes themselves go back to
+    // the system slab by slab when the pool is destroyed
+    ~Document()
+    {
+        for (auto para : paragraphs)
+        {
+            for (auto line : para->lines)
+            {
+                line->~Line();
+            }
+            para->~Para();
+        }
+        delete words;
+        delete live;
+        delete suffixes;
+        delete source;
+    }
+
+    void convertToUpperCase()
+    {
+        convertChars(true);
+    }
+
+    void convertToLowerCase()
+    {
+        convertChars(false);
+    }
+
+    void convertChars(bool upper)
+    {
+        int (*convert)(int) = upper ? ::toupper : ::tolower;
+        if (!replaying)
+        {
+            // Log the old text of the lines that will change
+            int row = 0;
+            for (auto para : paragraphs)
+            {
+                for (auto line : para->lines)
+                {
+                    if (line->anyChar([&](unsigned char c)
+                                      { return convert(c) != c; }))
+                    {
+                        history.converted(row, upper, line->getContent());
+                    }
+                    row++;
+                }
+            }
+        }
+        forEachChunk([&](const LineChunk &chunk)
+                     { chunk.forEach([&](int, Line *line)
+                                     { line->convertChars(convert); }); });
+        enableWordIndex(words != nullptr);
+    }
+
+    // Every counter of the statistics commands, in one pass over the text
+    // spread over the WorkPool
+    TextStats statistics()
+    {
+        return reduceLines(TextStats(), [&](const LineChunk &chunk)
+                           {
+                               TextStats stats;
+                               chunk.forEach([&](int, Line *line)
+                                             { stats.addLine(chunk.para, line->view()); });
+                               return stats; },
+                           [](TextStats all, const TextStats &next)
+                           {
+                               all.merge(next);
+                               return all; });
+    }
+
+    // How often every word occurs, in tables that split the words between
+    // them by hash. Each thread counts one run of chunks into a table of
+    // its own, then each shard is merged from all of them in parallel. The
+    // keys point into the lines, so the document must not change while the
+    // tables are in use.
+    vector<WordCounts> wordFrequencies()
+    {
+        vector<LineChunk> chunks = lineChunks();
+        WorkPool &pool = WorkPool::shared();
+        size_t threads = pool.threadCount();
+        vector<WordCounts> partial(threads);
+        pool.forEach(threads, [&](size_t t)
+                     {
+                         for (size_t i = chunks.size() * t / threads; i < chunks.size() * (t + 1) / threads; ++i)
+                         {
+                             chunks[i].forEach([&](int, Line *line)
+                                               { Tokenizer::forEach(line->view(), Tokenizer::Spaces, [&](string_view word)
+                                                                    { partial[t].add(word); }); });
+                         }
+                     });
+        if (threads == 1)
+        {
+            return partial;
+        }
+        vector<WordCounts> shards(threads);
+        pool.forEach(threads, [&](size_t shard)
+                     {
+                         for (const WordCounts &counts : partial)
+                         {
+                             shards[shard].mergeShard(counts, shard, threads);
+                         }
+                     });
+        return shards;
+    }
+
+    // Positions of the non-overlapping matches of `word`, in document order.
+    // Lines are searched in place, with or without case folding, so both
+    // kinds of search run at the same speed.
+    vector<TextMatch> findWord(const string &word, bool caseSensitive)
+    {
+        vector<TextMatch> matches;
+        if (word.empty())
+        {
+            return matches;
+        }
+        TextSearch search(word, caseSensitive);
+        return reduceLines(matches, [&](const LineChunk &chunk)
+                           {
+                               vector<TextMatch> found;
+                               chunk.forEach([&](int row, Line *line)
+                                             {
+                                                 string_view content = line->view();
+                                                 for (size_t pos = search.find(content); pos != string_view::npos;
+                                                      pos = search.find(content, pos + word.size()))
+                                                 {
+                                                     found.push_back({row, (int)pos, (int)word.size()});
+                                                 }
+                                             });
+                               return found; },
+                           appendMatches);
+    }
+
+    // Positions of the non-overlapping matches of a regular expression
+    vector<TextMatch> findPattern(const Regex &regex)
+    {
+        // The DFA cache and VM are not shared, so each thread has its own
+        // copy, which keeps its cache for the whole scan
+        vector<Regex> perThread(WorkPool::shared().threadCount(), regex);
+        return reduceLines(vector<TextMatch>(), [&](const LineChunk &chunk)
+                           {
+                               Regex &local = perThread[WorkPool::threadIndex()];
+                               vector<TextMatch> found;
+                               chunk.forEach([&](int row, Line *line)
+                                             { local.forEachMatch(line->view(), [&](const vector<int> &group)
+                                                                  { found.push_back({row, group[0], group[1] - group[0]}); }); });
+                               return found; },
+                           appendMatches);
+    }
+
+    static vector<TextMatch> appendMatches(vector<TextMatch> all, vector<TextMatch> more)
+    {
+        all.insert(all.end(), more.begin(), more.end());
+        return all;
+    }
+
+    // Move (row, col) to the next occurrence of a whole word after it,
+    // wrapping at the end of the document; needs the word index. The lines
+    // right below are checked first, which finds common words at once;
+    // otherwise the rows of the word's posting list are sorted, at O(log n)
+    // a line, and searched for the first one after the cursor. The sorted
+    // rows are kept until the text changes, so pressing F9 again only
+    // costs the search. Returns false if the word does not occur.
+    bool nextWord(string_view text, int &row, int &col, bool &wrapped)
+    {
+        const WordIndex::Word *word = words == nullptr ? nullptr : words->find(text);
+        if (word == nullptr)
+        {
+            return false;
+        }
+        wrapped = false;
+
+        const int Nearby = 64;
+        for (int r = row; r < min(lineCount(), row + Nearby + 1); ++r)
+        {
+            Line *line = getLine(r);
+            int found = words->lineHas(line, word) ? wordColumn(line, text, r == row ? col + 1 : 0) : -1;
+            if (found >= 0)
+            {
+                row = r;
+                col = found;
+                return true;
+            }
+        }
+
+        if (text != rankedText || rankedAt != Line::edits || rankedLines != lineCount())
+        {
+            rankedRows.clear();
+            for (const Line *line : word->lines)
+            {
+                Para *para = words->paraOf(line);
+                rankedRows.push_back(lineIndex.prefix(paraIndexes.at(para)) + para->lines.indexOf(line));
+            }
+            sort(rankedRows.begin(), rankedRows.end());
+            rankedText = text;
+            rankedAt = Line::edits;
+            rankedLines = lineCount();
+        }
+        auto after = upper_bound(rankedRows.begin(), rankedRows.end(), row);
+        wrapped = after == rankedRows.end();
+        row = wrapped ? rankedRows.front() : *after;
+        col = wordColumn(getLine(row), text, 0);
+        return true;
+    }
+
+private:
+    SuffixIndex *suffixes;
+    unsigned long long suffixesAt;   // Line::edits when it was built
+    unsigned long long editsAtStart; // Line::edits when the document was made
+    bool replaying;                  // Undo or redo is editing; do not log
+    NodePool pool;
+    Fenwick lineIndex;
+    Fenwick spanIndex;
+    vector<int> lineCounts;
+    vector<long long> spanCounts;
+    unordered_map<const Para *, int> paraIndexes; // Position of each paragraph in `paragraphs`
+    string rankedText;           // Word whose rows nextWord() sorted last
+    unsigned long long rankedAt; // Line::edits when they were sorted
+    int rankedLines;             // lineCount() when they were sorted
+    vector<int> rankedRows;
+
+    // Column of the first whole word equal to `text` that starts at or
+    // after `from`, or -1
+    static int wordColumn(Line *line, string_view text, int from)
+    {
+        string_view content = line->view();
+        int found = -1;
+        Tokenizer words(content);
+        string_view word;
+        while (found < 0 && words.next(word))
+        {
+            int start = word.data() - content.data();
+            if (start >= from && word == text)
+            {
+                found = start;
+            }
+        }
+        return found;
+    }
+
+    static long long spanOf(Para *para)
+    {
+        return para->lines.charCount() + para->lineCount();
+    }
+
+    // Keep the live totals in step with a line that is about to change
+    // (uncount) and has changed (count)
+    void uncount(Line *line)
+    {
+        if (live != nullptr)
+        {
+            live->countLine(line->view(), -1);
+        }
+    }
+
+    void count(Line *line)
+    {
+        if (live != nullptr)
+        {
+            live->countLine(line->view(), 1);
+        }
+    }
+
+    // Same for a replacement of [col, col + len) only: the words it can
+    // change are in the run of non-space bytes around it, so a keystroke
+    // recounts that run and not the line. Read around the gap, so the gap
+    // stays at the edit.
+    void countAround(Line *line, int col, int len, int sign)
+    {
+        if (live == nullptr)
+        {
+            return;
+        }
+        const unsigned char *table = Tokenizer::classes();
+        int start = col;
+        int end = col + len;
+        while (start > 0 && !(table[(unsigned char)line->charAt(start - 1)] & Tokenizer::Space))
+        {
+            --start;
+        }
+        while (end < line->length() && !(table[(unsigned char)line->charAt(end)] & Tokenizer::Space))
+        {
+            ++end;
+        }
+        live->blankLines += sign * (line->length() == 0);
+        live->countText(line->substr(start, end - start), sign);
+    }
+
+    // Log the edits [first, end) of a batch, which all change one line
+    void record(const EditBatch &batch, size_t first, size_t end)
+    {
+        const auto &edit = batch.edits[first];
+        Para *para = paragraphs[edit.paraIndex];
+        int row = lineIndex.prefix(edit.paraIndex) + para->lines.indexOf(edit.line);
+        long long shift = 0;
+        for (size_t i = first; i < end; ++i)
+        {
+            const auto &next = batch.edits[i];
+            string_view text = string_view(batch.texts).substr(next.textStart, next.textLength);
+            history.replaced(row, next.pos + shift, edit.line->substr(next.pos, next.len), text);
+            shift += (long long)text.size() - next.len;
+        }
+    }
+
+    // Play a step of the history backwards (undo) or forwards (redo)
+    bool replay(bool forward, int &row, int &col)
+    {
+        string step;
+        if (!(forward ? history.redo(step) : history.undo(step)))
+        {
+            return false;
+        }
+        replaying = true;
+        UndoLog::forEachOp(step, !forward, [&](const UndoLog::Op &op)
+                           { replayOp(op, forward, row, col); });
+        replaying = false;
+        return true;
+    }
+
+    void replayOp(const UndoLog::Op &op, bool forward, int &row, int &col)
+    {
+        row = op.row;
+        col = op.col;
+        switch (op.kind)
+        {
+        case 'r':
+            replaceAt(op.row, op.col, (forward ? op.removed : op.inserted).size(),
+                      forward ? op.inserted : op.removed);
+            col += (forward ? op.inserted : op.removed).size();
+            break;
+        case 's':
+            if (forward)
+            {
+                splitLine(op.row, op.col, op.paraBreak);
+                row++;
+                col = 0;
+            }
+            else
+            {
+                joinWithPrevious(op.row + 1);
+            }
+            break;
+        case 'j':
+            if (forward)
+            {
+                joinWithPrevious(op.row);
+                row--;
+            }
+            else
+            {
+                splitLine(op.row - 1, op.col, op.paraBreak);
+                col = 0;
+            }
+            break;
+        default: // 'U' or 'L'
+            if (forward)
+            {
+                convertRow(op.row, op.kind == 'U');
+            }
+            else
+            {
+                replaceAt(op.row, 0, op.removed.size(), op.removed);
+            }
+            break;
+        }
+    }
+
+    void convertRow(int row, bool upper)
+    {
+        int paraIndex, localRow;
+        if (locateRow(row, paraIndex, localRow))
+        {
+            Line *line = paragraphs[paraIndex]->getLine(localRow);
+            line->convertChars(upper ? ::toupper : ::tolower);
+            if (words != nullptr)
+            {
+                words->updateLine(paragraphs[paraIndex], line);
+            }
+        }
+    }
+
+    void rebuildIndex()
+    {
+        lineIndex.clear();
+        spanIndex.clear();
+        lineCounts.clear();
+        spanCounts.clear();
+        paraIndexes.clear();
+        vector<Para *> current;
+        current.swap(paragraphs);
+        for (auto para : current)
+        {
+            addParagraph(para);
+        }
+    }
+};
+
+// Reads a file into a paragraph of lines on a background thread and
+// measures how fast it went. The worker only finds line boundaries and
+// queues them in batches; the UI thread moves finished batches into the
+// document with drainInto(), so the document is never touched by two
+// threads and the first screen can be shown while the rest is still loading.
+//
+// Regular files are mapped and every line becomes a view into the mapping;
+// pipes, empty and unmappable files are read in 1 MB blocks and each line
+// is built with a single append. Newlines are located 16 bytes at a time
+// with SSE2 (memchr where SSE2 is not available).
+class FileLoader
+{
+public:
+    size_t bytesLoaded;
+    int linesLoaded;
+    double seconds;
+
+    FileLoader()
+        : bytesLoaded(0), linesLoaded(0), seconds(0), mappedBase(nullptr), totalBytes(0),
+          bytesScanned(0), stopRequested(false), workerDone(false), readFailed(false) {}
+
+    ~FileLoader()
+    {
+        cancel();
+    }
+
+    // Begin loading `filename`; lines become available through drainInto()
+    bool start(const string &filename, Document *document)
+    {
+        started = chrono::steady_clock::now();
+        MappedFile *mapped = new MappedFile(filename);
+        if (mapped->isOpen())
+        {
+            // Nothing is copied until a line is edited
+            document->attachSource(mapped);
+            mappedBase = mapped->data();
+            totalBytes = mapped->size();
+            worker = thread(&FileLoader::scanMapping, this, mapped);
+            return true;
+        }
+        delete mapped;
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        worker = thread(&FileLoader::readBlocks, this, fd);
+        return true;
+    }
+
+    // Load the whole file before returning
+    bool load(const string &filename, Document *document, Para *para)
+    {
+        if (!start(filename, document))
+        {
+            return false;
+        }
+        wait();
+        drainInto(document, para, INT_MAX);
+        return !readFailed;
+    }
+
+    // Block until the worker has found every line
+    void wait()
+    {
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+
+    // Append up to `maxBatches` queued batches of lines to `para` and return
+    // how many lines were added
+    int drainInto(Document *document, Para *para, int maxBatches)
+    {
+        deque<Batch> taken;
+        {
+            lock_guard<mutex> guard(queueLock);
+            while (!ready.empty() && (int)taken.size() < maxBatches)
+            {
+                taken.push_back(move(ready.front()));
+                ready.pop_front();
+            }
+        }
+
+        int added = 0;
+        vector<Line *> lines;
+        for (auto &batch : taken)
+        {
+            lines.clear();
+            lines.reserve(batch.spans.size());
+            for (auto span : batch.spans)
+            {
+                if (mappedBase != nullptr)
+                {
+                    lines.push_back(document->newLine(mappedBase + span.first, span.second));
+                }
+                else
+                {
+                    Line *line = document->newLine();
+                    line->append(batch.storage.data() + span.first, span.second);
+                    lines.push_back(line);
+                }
+            }
+            document->addLines(para, lines);
+            added += lines.size();
+        }
+        linesLoaded += added;
+        if (finished())
+        {
+            bytesLoaded = bytesScanned;
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        }
+        return added;
+    }
+
+    // True once the worker has stopped and every batch has been drained
+    bool finished()
+    {
+        if (!workerDone)
+        {
+            return false;
+        }
+        lock_guard<mutex> guard(queueLock);
+        return ready.empty();
+    }
+
+    // Stop the worker; batches that were not drained are dropped
+    void cancel()
+    {
+        stopRequested = true;
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+
+    bool failed() const
+    {
+        return readFailed;
+    }
+
+    // Fraction of the file scanned so far, or -1 when the size is unknown
+    double progress() const
+    {
+        return totalBytes > 0 ? (double)bytesScanned / totalBytes : -1;
+    }
+
+    double megabytesPerSecond() const
+    {
+        return seconds > 0 ? bytesLoaded / (1024.0 * 1024.0) / seconds : 0;
+    }
+
+    string report() const
+    {
+        char text[160];
+        snprintf(text, sizeof(text), "Loaded %d lines (%.1f MB) in %.3f s, %.0f MB/s",
+                 linesLoaded, bytesLoaded / (1024.0 * 1024.0), seconds, megabytesPerSecond());
+        return text;
+    }
+
+    // Call emit(text, len) for every '\n'-terminated line in [data, end) and
+    // return where the unterminated remainder starts
+    template <class Emit>
+    static const char *splitLines(const char *data, const char *end, Emit emit)
+    {
+        return splitLines(data, data, end, emit);
+    }
+
+    // Same, for a line that began at `lineStart` with scanning resuming at
+    // `pos`, so a long line split across chunks is not rescanned
+    template <class Emit>
+    static const char *splitLines(const char *lineStart, const char *pos, const char *end, Emit emit)
+    {
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        for (; end - pos >= 16; pos += 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+            while (mask != 0)
+            {
+                const char *hit = pos + __builtin_ctz(mask);
+                emit(lineStart, hit - lineStart);
+                lineStart = hit + 1;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        while (pos < end)
+        {
+            const char *hit = static_cast<const char *>(memchr(pos, '\n', end - pos));
+            if (hit == nullptr)
+            {
+                break;
+            }
+            emit(lineStart, hit - lineStart);
+            lineStart = pos = hit + 1;
+        }
+        return lineStart;
+    }
+
+private:
+    // Lines found by the worker: offsets into the mapping, or into
+    // `storage` when the file is read in blocks
+    struct Batch
+    {
+        string storage;
+        vector<pair<size_t, size_t>> spans; // (offset, length)
+    };
+
+    const char *mappedBase;
+    size_t totalBytes;
+    atomic<size_t> bytesScanned;
+    atomic<bool> stopRequested;
+    atomic<bool> workerDone;
+    atomic<bool> readFailed;
+    chrono::steady_clock::time_point started;
+    thread worker;
+    mutex queueLock;
+    deque<Batch> ready;
+
+    void publish(Batch &batch)
+    {
+        lock_guard<mutex> guard(queueLock);
+        ready.push_back(move(batch));
+    }
+
+    void scanMapping(MappedFile *mapped)
+    {
+        const size_t ChunkSize = 4 << 20;
+        const char *data = mapped->data();
+        const char *end = data + mapped->size();
+        const char *lineStart = data;
+        const char *pos = data;
+        mapped->advise(MADV_SEQUENTIAL);
+        while (pos < end && !stopRequested)
+        {
+            const char *chunkEnd = (size_t)(end - pos) > ChunkSize ? pos + ChunkSize : end;
+            Batch batch;
+            lineStart = splitLines(lineStart, pos, chunkEnd, [&](const char *text, size_t len)
+                                   { batch.spans.push_back({text - data, len}); });
+            if (chunkEnd == end && lineStart < end)
+            {
+                batch.spans.push_back({lineStart - data, end - lineStart});
+            }
+            pos = chunkEnd;
+            bytesScanned = pos - data;
+            publish(batch);
+        }
+        mapped->advise(MADV_NORMAL);
+        workerDone = true;
+    }
+
+    void readBlocks(int fd)
+    {
+        const size_t BlockSize = 1 << 20;
+        vector<char> block(BlockSize);
+        string carry; // Start of a line that continues in the next block
+        ssize_t count = 0;
+        while (!stopRequested)
+        {
+            count = read(fd, block.data(), BlockSize);
+            if (count < 0 && errno == EINTR)
+            {
+                continue; // A signal (SIGWINCH, ...) arrived before any data
+            }
+            if (count <= 0)
+            {
+                break;
+            }
+            Batch batch;
+            const char *end = block.data() + count;
+            const char *rest = splitLines(block.data(), end, [&](const char *text, size_t len)
+                                          {
+                size_t offset = batch.storage.size();
+                batch.storage += carry;
+                carry.clear();
+                batch.storage.append(text, len);
+                batch.spans.push_back({offset, batch.storage.size() - offset}); });
+            carry.append(rest, end - rest);
+            bytesScanned += count;
+            publish(batch);
+        }
+        if (count < 0)
+        {
+            readFailed = true;
+        }
+        if (!carry.empty() && !stopRequested)
+        {
+            Batch batch;
+            batch.storage = carry;
+            batch.spans.push_back({0, carry.size()});
+            publish(batch);
+        }
+        close(fd);
+        workerDone = true;
+    }
 
-    Letter(char c) : ch(c), next(nullptr) {}
+    FileLoader(const FileLoader &) = delete;
+    FileLoader &operator=(const FileLoader &) = delete;
 };
 
-class Line
+// Find/replace over a file on disk without loading it into a document. The
+// file is read in 4 MB chunks and the result is written to a temporary file
+// that is renamed over the original only once it is complete, so memory use
+// does not depend on the file size and a failure leaves the original as it
+// was. A plain-text match may straddle two chunks, so the last
+// (pattern length - 1) bytes of each chunk are held back and searched again
+// with the next one. Regular expressions match within a line, as they do in
+// the editor: only complete lines are matched and the unfinished last line
+// is carried over, so memory grows with the longest line at most.
+class StreamReplace
 {
 public:
-    list<Letter *> letters;
+    long long replaced;
+    long long bytesRead;
+    double seconds;
 
-    void insertCharAt(int pos, char c)
+    // Replace plain text
+    StreamReplace(const string &pattern, const string &replacement)
+        : replaced(0), bytesRead(0), seconds(0), pattern(pattern), replacement(replacement), regex(nullptr) {}
+
+    // Replace a regular expression; `replacement` may refer to groups as \0 to \9
+    StreamReplace(const Regex &regex, const string &replacement)
+        : replaced(0), bytesRead(0), seconds(0), replacement(replacement), regex(&regex) {}
+
+    // Rewrite `path` in place; on failure error() says why
+    bool run(const string &path)
+    {
+        auto started = chrono::steady_clock::now();
+        string tempName = path + ".replacing";
+        int in = ::open(path.c_str(), O_RDONLY);
+        if (in < 0)
+        {
+            return fail("cannot open " + path);
+        }
+        struct stat fileStat;
+        fstat(in, &fileStat);
+        int out = ::open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, fileStat.st_mode & 07777);
+        if (out < 0)
+        {
+            close(in);
+            return fail("cannot create " + tempName);
+        }
+
+        bool ok = copyReplacing(in, out);
+        ok = fsync(out) == 0 && ok;
+        ok = close(out) == 0 && ok;
+        close(in);
+        if (!ok || rename(tempName.c_str(), path.c_str()) != 0)
+        {
+            unlink(tempName.c_str());
+            return fail(failure.empty() ? "cannot write " + tempName : failure);
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        return true;
+    }
+
+    const string &error() const
     {
-        auto it = letters.begin();
-        advance(it, pos);
-        letters.insert(it, new Letter(c));
+        return failure;
     }
 
-    void removeCharAt(int pos)
+private:
+    static const size_t ChunkBytes = 4 << 20;
+
+    string pattern;
+    string replacement;
+    const Regex *regex;
+    string failure;
+
+    bool fail(const string &why)
     {
-        auto it = letters.begin();
-        advance(it, pos);
-        delete *it;
-        letters.erase(it);
+        failure = why;
+        return false;
     }
 
-    void printLine()
+    bool copyReplacing(int in, int out)
     {
-        for (auto letter : letters)
+        TextSearch search(pattern);
+        Regex local = regex != nullptr ? *regex : Regex("");
+        string buffer; // Carried over bytes, then the chunk just read
+        string output;
+        ssize_t count;
+        do
         {
-            if (letter != nullptr)
+            size_t kept = buffer.size();
+            buffer.resize(kept + ChunkBytes);
+            while ((count = read(in, &buffer[kept], ChunkBytes)) < 0 && errno == EINTR)
             {
-                addch(letter->ch);
             }
-        }
+            if (count < 0)
+            {
+                return fail("read failed");
+            }
+            buffer.resize(kept + count);
+            bytesRead += count;
+
+            size_t done = regex != nullptr ? replaceLines(local, buffer, count == 0, output)
+                                           : replaceText(search, buffer, count == 0, output);
+            buffer.erase(0, done);
+            if (!writeAll(out, output))
+            {
+                return false;
+            }
+            output.clear();
+        } while (count > 0);
+        return true;
     }
 
-    string getContent()
+    // Copy `text` to `output` with its matches replaced, up to where a match
+    // could still continue in the next chunk; returns how far it got
+    size_t replaceText(const TextSearch &search, string_view text, bool last, string &output)
     {
-        string content;
-        for (auto letter : letters)
+        if (pattern.empty())
         {
-            content += letter->ch;
+            output.append(text);
+            return text.size();
         }
-        return content;
+        size_t from = 0;
+        for (size_t pos = search.find(text, from); pos != string_view::npos; pos = search.find(text, from))
+        {
+            output.append(text, from, pos - from);
+            output += replacement;
+            from = pos + pattern.size();
+            replaced++;
+        }
+        // No match starts before this, so only the bytes after it can begin one
+        size_t keep = last ? text.size() : max(from, text.size() - min(text.size(), pattern.size() - 1));
+        output.append(text, from, keep - from);
+        return keep;
     }
 
-    int length()
+    // The same for a regex, a complete line at a time
+    size_t replaceLines(Regex &local, string_view text, bool last, string &output)
     {
-        return letters.size();
+        vector<int> groups;
+        auto replaceLine = [&](const char *start, size_t len)
+        {
+            string_view line(start, len);
+            size_t from = 0;
+            size_t copied = 0;
+            if (local.matches(line))
+            {
+                while (from <= line.size() && local.find(line, from, groups))
+                {
+                    output.append(line, copied, groups[0] - copied);
+                    output += Regex::expand(line, groups, replacement);
+                    copied = groups[1];
+                    from = groups[1] > groups[0] ? groups[1] : groups[1] + 1;
+                    replaced++;
+                }
+            }
+            output.append(line, copied);
+        };
+        const char *end = text.data() + text.size();
+        const char *rest = FileLoader::splitLines(text.data(), end, [&](const char *start, size_t len)
+                                                  {
+                                                      replaceLine(start, len);
+                                                      output += '\n'; });
+        if (last)
+        {
+            if (rest < end)
+            {
+                replaceLine(rest, end - rest); // No newline at the end of the file
+            }
+            return text.size();
+        }
+        return rest - text.data();
     }
 
-    ~Line()
+    bool writeAll(int fd, const string &data)
     {
-        for (auto letter : letters)
+        for (size_t written = 0; written < data.size();)
         {
-            delete letter;
+            ssize_t count = write(fd, data.data() + written, data.size() - written);
+            if (count < 0 && errno != EINTR)
+            {
+                return fail(string("write failed: ") + strerror(errno));
+            }
+            written += max<ssize_t>(count, 0);
         }
+        return true;
     }
 };
 
-class Para
+// Word game engine: finds the words that can be spelled with a set of
+// letters, each used at most as often as it is given. Every word carries a
+// 64-bit mask of the kinds of bytes it contains, so nearly all candidates
+// are rejected by one AND against the letters' mask before any counting;
+// the rest are counted against a 256-bucket signature of the letters. The
+// masks and word references are two flat arrays, which for a dictionary
+// file are saved next to it and mapped back in.
+class WordGame
 {
 public:
-    list<Line *> lines;
+    WordGame() : stored(nullptr), dictionary(nullptr), masks(nullptr), refs(nullptr), text(nullptr), wordCount(0)
+    {
+        memset(&opened, 0, sizeof(opened));
+    }
 
-    void addLine(Line *line)
+    ~WordGame()
     {
-        lines.push_back(line);
+        delete stored;
+        delete dictionary;
     }
 
-    ~Para()
+    // Add one word to an in-memory vocabulary; the spelling is copied
+    void add(string_view word)
     {
-        for (auto line : lines)
+        if (word.size() <= MaxLength)
         {
-            delete line;
+            builtMasks.push_back(maskOf(word));
+            builtRefs.push_back(makeRef(pool.size(), word.size()));
+            pool.append(word);
+            attach(builtMasks.data(), builtRefs.data(), pool.data(), builtMasks.size());
         }
     }
 
-    int lineCount()
+    // Use the whitespace separated words of a dictionary file. The index is
+    // mapped from `path + ".wg"` when it matches the file, else built and
+    // saved there; `how` says which. False if the file cannot be read.
+    bool openDictionary(const string &path, const char *&how)
     {
-        return lines.size();
+        MappedFile *mapped = new MappedFile(path);
+        struct stat fileStat;
+        if (!mapped->isOpen() || stat(path.c_str(), &fileStat) != 0 || (size_t)fileStat.st_size != mapped->size())
+        {
+            delete mapped;
+            return false;
+        }
+        delete stored;
+        delete dictionary;
+        stored = nullptr;
+        dictionary = mapped;
+        opened = fileStat;
+        builtMasks.clear();
+        builtRefs.clear();
+        pool.clear();
+
+        string indexName = path + ".wg";
+        if (load(indexName, fileStat))
+        {
+            how = "loaded";
+            return true;
+        }
+        string_view all(mapped->data(), mapped->size());
+        Tokenizer::forEach(all, Tokenizer::Spaces, [&](string_view word)
+                           {
+                               if (word.size() <= MaxLength)
+                               {
+                                   builtMasks.push_back(maskOf(word));
+                                   builtRefs.push_back(makeRef(word.data() - all.data(), word.size()));
+                               }
+                           });
+        attach(builtMasks.data(), builtRefs.data(), mapped->data(), builtMasks.size());
+        how = save(indexName, fileStat) ? "built and saved" : "built (could not save)";
+        return true;
     }
 
-    Line *getLine(int index)
+    // Whether the dictionary file was changed since it was opened
+    bool changed(const string &path) const
     {
-        auto it = lines.begin();
-        advance(it, index);
-        return *it;
+        struct stat fileStat;
+        return stat(path.c_str(), &fileStat) != 0 || fileStat.st_size != opened.st_size ||
+               fileStat.st_mtim.tv_sec != opened.st_mtim.tv_sec ||
+               fileStat.st_mtim.tv_nsec != opened.st_mtim.tv_nsec;
     }
-};
 
-class Document
-{
-public:
-    list<Para *> paragraphs;
+    size_t size() const
+    {
+        return wordCount;
+    }
 
-    void addParagraph(Para *para)
+    // Call found(word, anagram) for every word that can be spelled with
+    // `letters`; anagram is true when the word uses all of them
+    template <class Found>
+    void formable(string_view letters, Found found) const
     {
-        paragraphs.push_back(para);
+        const unsigned char *bits = maskBits();
+        uint64_t have = 0;
+        array<int, 256> left{};
+        for (unsigned char c : letters)
+        {
+            have |= 1ull << bits[c];
+            left[c]++;
+        }
+        uint64_t missing = ~have;
+        for (size_t i = 0; i < wordCount; ++i)
+        {
+            size_t length = refs[i] & MaxLength;
+            if ((masks[i] & missing) != 0 || length > letters.size())
+            {
+                continue;
+            }
+            const unsigned char *word = reinterpret_cast<const unsigned char *>(text) + (refs[i] >> LengthBits);
+            size_t used = 0;
+            while (used < length && left[word[used]] > 0)
+            {
+                left[word[used++]]--;
+            }
+            bool fits = used == length;
+            while (used > 0)
+            {
+                left[word[--used]]++;
+            }
+            if (fits)
+            {
+                found(string_view(reinterpret_cast<const char *>(word), length), length == letters.size());
+            }
+        }
     }
 
-    void printDocument()
+    // Bit of each byte in a word mask: one per letter and digit, and two
+    // shared by everything else
+    static const unsigned char *maskBits()
     {
-        int lineIndex = 0;
-        for (auto para : paragraphs)
+        static const array<unsigned char, 256> table = []
         {
-            for (auto line : para->lines)
+            array<unsigned char, 256> table{};
+            for (int c = 0; c < 256; ++c)
             {
-                mvprintw(lineIndex++, 0, line->getContent().c_str());
+                table[c] = islower(c) ? c - 'a' : isupper(c) ? 26 + c - 'A' : isdigit(c) ? 52 + c - '0' : 62 + (c & 1);
             }
+            return table;
+        }();
+        return table.data();
+    }
+
+    static uint64_t maskOf(string_view word)
+    {
+        const unsigned char *bits = maskBits();
+        uint64_t mask = 0;
+        for (unsigned char c : word)
+        {
+            mask |= 1ull << bits[c];
         }
+        return mask;
     }
-    int paraCount() const
+
+private:
+    // A word reference is its offset in the text above a 16-bit length
+    static const int LengthBits = 16;
+    static const size_t MaxLength = (1 << LengthBits) - 1;
+
+    struct Header
     {
-        return paragraphs.size();
+        char magic[8];
+        uint64_t textSize;
+        int64_t modifiedSeconds;
+        int64_t modifiedNanoseconds;
+        uint64_t wordCount;
+    };
+
+    MappedFile *stored; // Saved index in use, if any
+    MappedFile *dictionary; // Dictionary file the words point into
+    struct stat opened;
+    vector<uint64_t> builtMasks;
+    vector<uint64_t> builtRefs;
+    string pool; // Spellings added with add()
+    const uint64_t *masks;
+    const uint64_t *refs;
+    const char *text;
+    size_t wordCount;
+
+    static uint64_t makeRef(size_t offset, size_t length)
+    {
+        return (uint64_t)offset << LengthBits | length;
     }
-    Para *getPara(int index)
+
+    void attach(const uint64_t *wordMasks, const uint64_t *wordRefs, const char *words, size_t count)
     {
-        if (index < 0 || index >= paragraphs.size())
+        masks = wordMasks;
+        refs = wordRefs;
+        text = words;
+        wordCount = count;
+    }
+
+    Header makeHeader(const struct stat &source, uint64_t count) const
+    {
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "TEXTWG1", 8);
+        header.textSize = source.st_size;
+        header.modifiedSeconds = source.st_mtim.tv_sec;
+        header.modifiedNanoseconds = source.st_mtim.tv_nsec;
+        header.wordCount = count;
+        return header;
+    }
+
+    bool save(const string &path, const struct stat &source) const
+    {
+        string tempName = path + ".saving";
+        ofstream out(tempName, ios::binary);
+        Header header = makeHeader(source, wordCount);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(masks), wordCount * sizeof(uint64_t));
+        out.write(reinterpret_cast<const char *>(refs), wordCount * sizeof(uint64_t));
+        out.close();
+        if (!out)
         {
-            return nullptr; // Check if index is out of bounds
+            remove(tempName.c_str());
+            return false;
         }
+        return rename(tempName.c_str(), path.c_str()) == 0;
+    }
 
-        // Use an iterator to access the element at the given index
-        auto it = paragraphs.begin();
-        std::advance(it, index); // Advance iterator to the desired index
-        return *it;              // Dereference iterator to get the element
+    bool load(const string &path, const struct stat &source)
+    {
+        MappedFile *mapped = new MappedFile(path);
+        Header header;
+        if (!mapped->isOpen() || mapped->size() < sizeof(Header))
+        {
+            delete mapped;
+            return false;
+        }
+        memcpy(&header, mapped->data(), sizeof(Header));
+        Header expected = makeHeader(source, header.wordCount);
+        if (memcmp(&header, &expected, sizeof(Header)) != 0 ||
+            mapped->size() != sizeof(Header) + header.wordCount * 2 * sizeof(uint64_t))
+        {
+            delete mapped;
+            return false;
+        }
+        delete stored;
+        stored = mapped;
+        const uint64_t *arrays = reinterpret_cast<const uint64_t *>(mapped->data() + sizeof(Header));
+        attach(arrays, arrays + header.wordCount, dictionary->data(), header.wordCount);
+        return true;
     }
 
-    void saveToFile(const string &filename)
+    WordGame(const WordGame &) = delete;
+    WordGame &operator=(const WordGame &) = delete;
+};
+
+// The matches of the last search, kept so the cursor can step through them
+// (F10 and Shift+F10) and the viewport can highlight them. They are dropped
+// as soon as any line is edited.
+//
+// Incremental search (Ctrl+S) finds every occurrence, overlapping ones too,
+// and keeps one list per typed prefix. Every occurrence of a longer query
+// is also one of the shorter query, so a new character only re-checks the
+// previous list, and Backspace goes back to the list before it.
+class SearchSession
+{
+public:
+    SearchSession() : editsAtSearch(0) {}
+
+    // Matches to show, valid for the current text
+    bool active() const
     {
-        ofstream file(filename);
-        for (auto para : paragraphs)
+        return !levels.empty() && editsAtSearch == Line::edits;
+    }
+
+    // There are matches, but the text has changed since they were found
+    bool expired() const
+    {
+        return !levels.empty() && editsAtSearch != Line::edits;
+    }
+
+    void clear()
+    {
+        levels.clear();
+        query.clear();
+    }
+
+    // Keep the results of a one-off search
+    void show(const vector<TextMatch> &matches)
+    {
+        clear();
+        levels.push_back({matches, true});
+        editsAtSearch = Line::edits;
+    }
+
+    const string &text() const
+    {
+        return query;
+    }
+
+    // Add a character to the incremental query
+    void extend(Document *document, char c)
+    {
+        query += c;
+        if (levels.empty() || !levels.back().complete || editsAtSearch != Line::edits)
+        {
+            levels.push_back(scan(document));
+        }
+        else
+        {
+            levels.push_back(narrow(document, levels.back()));
+        }
+        editsAtSearch = Line::edits;
+    }
+
+    // Take the last character off the incremental query
+    void shorten()
+    {
+        if (!query.empty())
+        {
+            query.pop_back();
+            levels.pop_back();
+        }
+    }
+
+    int size() const
+    {
+        return levels.empty() ? 0 : levels.back().matches.size();
+    }
+
+    // True when there were more matches than are kept
+    bool truncated() const
+    {
+        return !levels.empty() && !levels.back().complete;
+    }
+
+    const TextMatch &at(int index) const
+    {
+        return levels.back().matches[index];
+    }
+
+    // Index of the first match at or after (row, col), wrapping round to
+    // the first one; -1 if there are none
+    int firstFrom(int row, int col) const
+    {
+        int index = lowerBound(row, col);
+        return size() == 0 ? -1 : index < size() ? index : 0;
+    }
+
+    // The next match after (row, col) and the one before it, wrapping
+    int after(int row, int col) const
+    {
+        return firstFrom(row, col + 1);
+    }
+
+    int before(int row, int col) const
+    {
+        int index = lowerBound(row, col);
+        return size() == 0 ? -1 : index > 0 ? index - 1 : size() - 1;
+    }
+
+    // Indexes [first, last) of the matches on a row
+    pair<int, int> onRow(int row) const
+    {
+        return {lowerBound(row, 0), lowerBound(row + 1, 0)};
+    }
+
+private:
+    struct Level
+    {
+        vector<TextMatch> matches; // In document order
+        bool complete;             // False if matches past MaxKept were dropped
+    };
+
+    static const size_t MaxKept = 1 << 20;
+
+    vector<Level> levels;
+    string query;
+    unsigned long long editsAtSearch; // Line::edits when the matches were found
+
+    int lowerBound(int row, int col) const
+    {
+        if (levels.empty())
+        {
+            return 0;
+        }
+        const vector<TextMatch> &matches = levels.back().matches;
+        auto found = lower_bound(matches.begin(), matches.end(), make_pair(row, col),
+                                 [](const TextMatch &match, const pair<int, int> &place)
+                                 { return make_pair(match.row, match.col) < place; });
+        return found - matches.begin();
+    }
+
+    Level scan(Document *document)
+    {
+        Level level{{}, true};
+        TextSearch search(query);
+        int row = 0;
+        for (auto para : document->paragraphs)
         {
             for (auto line : para->lines)
             {
-                for (auto letter : line->letters)
+                string_view content = line->view();
+                for (size_t pos = search.find(content); pos != string_view::npos; pos = search.find(content, pos + 1))
                 {
-                    file << letter->ch;
+                    if (level.matches.size() == MaxKept)
+                    {
+                        level.complete = false;
+                        return level;
+                    }
+                    level.matches.push_back({row, (int)pos, (int)query.size()});
                 }
-                file << '\n';
+                row++;
             }
-            file << '\n';
         }
-        file.close();
+        return level;
     }
 
-    Line *getLine(int index)
+    // The matches of the query among those of the query minus its last
+    // character
+    Level narrow(Document *document, const Level &previous)
     {
-        int lineCount = 0;
-        for (auto para : paragraphs)
+        Level level{{}, true};
+        int lastRow = -1;
+        string_view content;
+        for (const TextMatch &match : previous.matches)
         {
-            for (auto line : para->lines)
+            if (match.row != lastRow)
             {
-                if (lineCount == index)
-                {
-                    return line; // Found the line
-                }
-                lineCount++;
+                lastRow = match.row;
+                content = document->getLine(match.row)->view();
+            }
+            if (content.substr(match.col, query.size()) == query)
+            {
+                level.matches.push_back({match.row, match.col, (int)query.size()});
             }
         }
-        return nullptr; // If no line is found
+        return level;
     }
+};
 
-    ~Document()
+// The part of the document that is on screen: `height` rows starting at
+// document row `top`, shifted left by `left` columns, with a status line
+// underneath. Only visible rows are ever materialized, so drawing a frame
+// costs the same for 50 lines as for 50 million.
+//
+// It also remembers which rows changed since the last frame so that only
+// those rows are repainted. Inserting or deleting a line shifts the rows
+// below it with insdelln(), which curses sends as a terminal scroll instead
+// of redrawing them. Anything not tracked row by row (prompts, commands that
+// edit the whole document, scrolling) falls back to a full repaint.
+class Viewport
+{
+public:
+    int top;
+    int left;
+
+    Viewport() : top(0), left(0), everything(true), search(nullptr) {}
+
+    int height() const
     {
-        for (auto para : paragraphs)
+        return max(1, LINES - 1);
+    }
+
+    // Back to the top left of a new document
+    void reset()
+    {
+        top = left = 0;
+        markAll();
+    }
+
+    void markAll()
+    {
+        everything = true;
+        shifts.clear();
+        rows.clear();
+    }
+
+    void markRow(int row)
+    {
+        if (!everything)
         {
-            delete para;
+            rows.insert(row);
         }
     }
 
-    void convertToUpperCase()
+    // A new line now occupies `row`; the rows from there down move down
+    void lineInserted(int row)
     {
-        for (auto para : paragraphs)
+        if (!everything)
         {
-            for (auto line : para->lines)
+            shifts.push_back({row, 1});
+            rows.insert(row);
+        }
+    }
+
+    // The line at `row` is gone; the rows below it move up
+    void lineRemoved(int row)
+    {
+        if (!everything)
+        {
+            shifts.push_back({row, -1});
+        }
+    }
+
+    // Text for the status line; it is shown until the next frame
+    void setMessage(const string &text)
+    {
+        message = text;
+    }
+
+    // Matches to draw in reverse video while they are valid
+    void highlight(const SearchSession *session)
+    {
+        search = session;
+    }
+
+    // Scroll so the cursor is visible, then draw what changed
+    void render(Document *document, int cursorRow, int cursorCol)
+    {
+        follow(cursorRow, cursorCol);
+        int lineCount = document->lineCount();
+        if (everything)
+        {
+            erase();
+            for (int screenRow = 0; screenRow < height(); ++screenRow)
+            {
+                drawRow(document, screenRow, lineCount);
+            }
+        }
+        else
+        {
+            for (auto shift : shifts)
+            {
+                int screenRow = shift.first - top;
+                if (screenRow >= 0 && screenRow < height())
+                {
+                    // Keep the status line out of the scrolled region
+                    move(height(), 0);
+                    clrtoeol();
+                    move(screenRow, 0);
+                    insdelln(shift.second);
+                }
+            }
+            for (int row : rows)
             {
-                for (auto letter : line->letters)
+                int screenRow = row - top;
+                if (screenRow >= 0 && screenRow < height())
                 {
-                    letter->ch = toupper(letter->ch);
+                    drawRow(document, screenRow, lineCount);
                 }
             }
+            // The row scrolled in at the bottom after a deletion
+            if (!shifts.empty())
+            {
+                drawRow(document, height() - 1, lineCount);
+            }
         }
+        drawStatus(document, cursorRow, cursorCol, lineCount);
+        move(cursorRow - top, cursorCol - left);
+
+        everything = false;
+        shifts.clear();
+        rows.clear();
+        message.clear();
     }
 
-    void convertToLowerCase()
+private:
+    bool everything;
+    vector<pair<int, int>> shifts; // (row, +1 inserted / -1 removed)
+    set<int> rows;
+    string message;
+    const SearchSession *search;
+
+    void follow(int cursorRow, int cursorCol)
     {
-        for (auto para : paragraphs)
+        int oldTop = top, oldLeft = left;
+        if (cursorRow < top)
         {
-            for (auto line : para->lines)
+            top = cursorRow;
+        }
+        else if (cursorRow >= top + height())
+        {
+            top = cursorRow - height() + 1;
+        }
+        if (cursorCol < left)
+        {
+            left = cursorCol;
+        }
+        else if (cursorCol >= left + COLS)
+        {
+            left = cursorCol - COLS + 1;
+        }
+        if (top != oldTop || left != oldLeft)
+        {
+            markAll();
+        }
+    }
+
+    void drawRow(Document *document, int screenRow, int lineCount)
+    {
+        move(screenRow, 0);
+        clrtoeol();
+        int row = top + screenRow;
+        if (row < lineCount)
+        {
+            document->getLine(row)->printLine(left, COLS);
+            if (search != nullptr && search->active())
             {
-                for (auto letter : line->letters)
-                {
-                    letter->ch = tolower(letter->ch);
-                }
+                drawMatches(screenRow, row);
             }
         }
     }
 
-    bool findWord(const string &word, bool caseSensitive)
+    void drawMatches(int screenRow, int row)
     {
-        string wordLower = word;
-        if (!caseSensitive)
+        pair<int, int> onRow = search->onRow(row);
+        for (int i = onRow.first; i < onRow.second; ++i)
         {
-            transform(wordLower.begin(), wordLower.end(), wordLower.begin(), ::tolower);
+            const TextMatch &match = search->at(i);
+            int start = max(match.col, left);
+            int end = min(match.col + max(match.length, 1), left + COLS);
+            if (start < end)
+            {
+                mvchgat(screenRow, start - left, end - start, A_REVERSE, 0, nullptr);
+            }
         }
+    }
 
-        for (auto para : paragraphs)
+    void drawStatus(Document *document, int cursorRow, int cursorCol, int lineCount)
+    {
+        string position = "Ln " + to_string(cursorRow + 1) + "/" + to_string(lineCount) +
+                          ", Col " + to_string(cursorCol + 1);
+        if (document->live != nullptr)
         {
-            for (auto line : para->lines)
+            // The live counts go in front of the position, shortened to fit
+            const TextStats &stats = *document->live;
+            char counts[160];
+            snprintf(counts, sizeof(counts), "Words %lld  Sentences %lld  Special %lld  Paragraphs %d  ",
+                     stats.words, stats.sentences, stats.special, document->paraCount());
+            if (message.size() + strlen(counts) + position.size() >= (size_t)COLS)
             {
-                string lineContent = line->getContent();
-                string lineContentLower = lineContent;
-                if (!caseSensitive)
-                {
-                    transform(lineContentLower.begin(), lineContentLower.end(), lineContentLower.begin(), ::tolower);
-                }
-
-                if (lineContentLower.find(wordLower) != string::npos)
-                {
-                    return true; // Word found
-                }
+                snprintf(counts, sizeof(counts), "W %lld S %lld Sp %lld P %d  ",
+                         stats.words, stats.sentences, stats.special, document->paraCount());
+            }
+            if (message.size() + strlen(counts) + position.size() < (size_t)COLS)
+            {
+                position = counts + position;
             }
         }
-        return false; // Word not found
+        move(height(), 0);
+        clrtoeol();
+        attron(A_REVERSE);
+        addnstr(message.c_str(), COLS);
+        attroff(A_REVERSE);
+        if ((int)(message.size() + position.size()) < COLS)
+        {
+            mvaddstr(height(), COLS - position.size() - 1, position.c_str());
+        }
     }
 };
 
@@ -256,8 +6085,24 @@ public:
     Document *currentDocument;
     int cursorRow;
     int cursorCol;
-
-    TextEditor() : currentDocument(new Document()), cursorRow(0), cursorCol(0) {}
+    Viewport screen;
+    string lastLoadReport;
+    FileLoader *loader; // Set while a file is still being loaded
+    string loadingName;
+    bool indexWords; // Keep a word index for every document (F8)
+    bool liveStats;  // Show running word and sentence counts (Shift+F5)
+    bool regexMode;  // Find, count and replace take regular expressions (Ctrl+B)
+    SearchSession searchResults;
+    int lastTyping; // 'i' or 'd' while a run of typing or deleting goes on
+    WordGame *dictionary; // Last dictionary file of the word game (Ctrl+E)
+    string dictionaryName;
+
+    TextEditor()
+        : currentDocument(new Document()), cursorRow(0), cursorCol(0), loader(nullptr), indexWords(false),
+          liveStats(true), regexMode(false), lastTyping(0), dictionary(nullptr)
+    {
+        screen.highlight(&searchResults);
+    }
     std::string getUserInput(const std::string &prompt)
     {
         char ch;
@@ -294,65 +6139,78 @@ public:
     void run()
     {
         initscr();
+        raw(); // Deliver Ctrl+C and friends to the editor instead of signals
         keypad(stdscr, TRUE);
         noecho();
 
-        Line *line = new Line();
-        Para *para = new Para();
+        Line *line = currentDocument->newLine();
+        Para *para = currentDocument->newPara();
         para->addLine(line);
         currentDocument->addParagraph(para);
+        currentDocument->enableLiveStats(liveStats);
 
         int ch;
         while ((ch = getch()) != KEY_F(1))
         {
-            int numLines = para->lineCount();
-            Line *currentLine = para->getLine(cursorRow);
+            if (loader != nullptr)
+            {
+                continueLoading(ch);
+                continue;
+            }
+
+            int numLines = currentDocument->lineCount();
+            Line *currentLine = currentDocument->getLine(cursorRow);
+            bool tracked = false; // Damage was recorded row by row
+
+            // A run of typed or deleted characters is undone in one step;
+            // any other key starts a new one
+            int typing = (ch == KEY_BACKSPACE || ch == 127) ? 'd' : (ch >= 32 && ch < 127) ? 'i' : 0;
+            if (typing == 0 || typing != lastTyping)
+            {
+                currentDocument->history.closeStep();
+            }
+            lastTyping = typing;
 
             switch (ch)
             {
             case KEY_UP:
+                tracked = true;
                 if (cursorRow > 0)
                 {
                     cursorRow--;
-                    if (cursorCol > para->getLine(cursorRow)->length())
+                    if (cursorCol > currentDocument->getLine(cursorRow)->length())
                     {
-                        cursorCol = para->getLine(cursorRow)->length();
+                        cursorCol = currentDocument->getLine(cursorRow)->length();
                     }
                 }
                 break;
             case KEY_DOWN:
+                tracked = true;
                 if (cursorRow < numLines - 1)
                 {
                     cursorRow++;
-                    if (cursorCol > para->getLine(cursorRow)->length())
+                    if (cursorCol > currentDocument->getLine(cursorRow)->length())
                     {
-                        cursorCol = para->getLine(cursorRow)->length();
+                        cursorCol = currentDocument->getLine(cursorRow)->length();
                     }
                 }
                 break;
             case KEY_LEFT:
+                tracked = true;
                 if (cursorCol > 0)
                 {
                     cursorCol--;
                 }
                 else if (cursorRow > 0)
                 {
-                    Line *prevLine = para->getLine(cursorRow - 1);
-                    int prevLength = prevLine->length();
-                    for (auto letter : currentLine->letters)
-                    {
-                        prevLine->insertCharAt(prevLength++, letter->ch);
-                    }
-                    auto it = para->lines.begin();
-                    advance(it, cursorRow);
-                    para->lines.erase(it);
-
-                    delete currentLine;
+                    cursorCol = currentDocument->joinWithPrevious(cursorRow);
+                    screen.lineRemoved(cursorRow);
                     cursorRow--;
-                    cursorCol = prevLength;
+                    screen.markRow(cursorRow);
                 }
                 break;
             case KEY_RIGHT:
+                tracked = true;
                 if (cursorCol < currentLine->length())
                 {
                     cursorCol++;
@@ -364,35 +6222,50 @@ public:
                 }
                 break;
             case 10: // Enter key
-                line = new Line();
-                para->addLine(line);
+                tracked = true;
+                currentDocument->splitLine(cursorRow, cursorCol);
+                screen.markRow(cursorRow);
                 cursorRow++;
+                screen.lineInserted(cursorRow);
                 cursorCol = 0;
                 break;
             case KEY_BACKSPACE: // Backspace key
             case 127:
+                tracked = true;
                 if (cursorCol > 0)
                 {
-                    currentLine->removeCharAt(cursorCol - 1);
+                    currentDocument->replaceAt(cursorRow, cursorCol - 1, 1, "");
                     cursorCol--;
+                    screen.markRow(cursorRow);
                 }
                 else if (cursorRow > 0)
                 {
-                    Line *prevLine = para->getLine(cursorRow - 1);
-                    int prevLength = prevLine->length();
-                    for (auto letter : currentLine->letters)
-                    {
-                        prevLine->insertCharAt(prevLength++, letter->ch);
-                    }
-                    auto it = para->lines.begin();
-                    advance(it, cursorRow);
-                    para->lines.erase(it);
-
-                    delete currentLine;
+                    cursorCol = currentDocument->joinWithPrevious(cursorRow);
+                    screen.lineRemoved(cursorRow);
                     cursorRow--;
-                    cursorCol = prevLength;
+                    screen.markRow(cursorRow);
                 }
                 break;
+            case KEY_PPAGE:
+                tracked = true;
+                cursorRow = max(0, cursorRow - screen.height());
+                cursorCol = min(cursorCol, currentDocument->getLine(cursorRow)->length());
+                break;
+            case KEY_NPAGE:
+                tracked = true;
+                cursorRow = min(numLines - 1, cursorRow + screen.height());
+                cursorCol = min(cursorCol, currentDocument->getLine(cursorRow)->length());
+                break;
+            case KEY_HOME:
+                tracked = true;
+                cursorCol = 0;
+                break;
+            case KEY_END:
+                tracked = true;
+                cursorCol = currentLine->length();
+                break;
+            case KEY_RESIZE:
+                break;
             case 20: // CTRL+T to save
                 saveDocument();
                 break;
@@ -413,7 +6286,7 @@ public:
                 findSentencePromt();
                 break;
             case 8:                    // CTRL+H for finding substring
-                findSubstringPrompt(); // TODO: implement
+                findSubstringPrompt();
                 break;
             case 9: // CTRL + I for Add prefix to word
                 AddPrefixToWord();
@@ -437,6 +6310,12 @@ public:
             case 23: // CTRL+W for replacing first word
                 replaceFirstWordPrompt();
                 break;
+            case 2: // CTRL+B to switch between plain text and regex search
+                tracked = true;
+                regexMode = !regexMode;
+                screen.setMessage(regexMode ? "Regex mode: find, count and replace take regular expressions"
+                                            : "Plain text mode");
+                break;
             case 1: // CTRL+A for replacing all words
                 replaceAllWordPrompt();
                 break;
@@ -464,18 +6343,72 @@ public:
             case KEY_F(6):
                 encodeFilePrompt();
                 break;
+            case KEY_F(5):
+                showDocumentInfo();
+                break;
+            case KEY_F(7):
+                multiPatternSearch();
+                break;
+            case KEY_F(8):
+                toggleWordIndex();
+                break;
+            case KEY_F(9):
+                tracked = true;
+                jumpToNextWord();
+                break;
+            case KEY_F(11):
+                toggleSuffixIndex();
+                break;
+            case KEY_F(12):
+                streamReplacePrompt();
+                break;
+            case KEY_F(17): // Shift+F5
+                liveStats = !liveStats;
+                currentDocument->enableLiveStats(liveStats);
+                break;
+            case 28: // CTRL+\ for the most frequent words
+                wordFrequencyReport();
+                break;
+            case 17: // CTRL+Q for the statistics report
+                statisticsReport();
+                break;
+            case 26: // CTRL+Z to undo
+                undoStep(false);
+                break;
+            case 25: // CTRL+Y to redo
+                undoStep(true);
+                break;
+            case 19: // CTRL+S for search as you type
+                incrementalSearch();
+                break;
+            case KEY_F(10):
+                stepToMatch(true);
+                break;
+            case KEY_F(22): // Shift+F10
+                stepToMatch(false);
+                break;
 
             default:
-                currentLine->insertCharAt(cursorCol, ch);
+                tracked = true;
+                currentDocument->replaceAt(cursorRow, cursorCol, 0, string(1, (char)ch));
                 cursorCol++;
+                screen.markRow(cursorRow);
                 break;
             }
+            if (searchResults.expired())
+            {
+                searchResults.clear(); // The positions no longer fit the text
+                tracked = false;
+            }
+            if (!tracked)
+            {
+                screen.markAll();
+            }
 
-            clear();
-            currentDocument->printDocument();
-            move(cursorRow, cursorCol);
+            screen.render(currentDocument, cursorRow, cursorCol);
         }
 
+        cancelLoading();
         endwin();
     }
 
@@ -533,32 +6466,207 @@ public:
             return;
         }
 
+        file.close();
+
+        // Lines stream into the (read-only) document while the editor keeps
+        // running; see continueLoading()
         delete currentDocument;
         currentDocument = new Document();
+        currentDocument->fileName = filename;
+        searchResults.clear();
+        currentDocument->addParagraph(currentDocument->newPara());
+        currentDocument->enableWordIndex(indexWords); // Filled in as lines arrive
+        cursorRow = 0;
+        cursorCol = 0;
+        screen.reset();
+
+        loader = new FileLoader();
+        loadingName = filename;
+        if (!loader->start(filename, currentDocument))
+        {
+            delete loader;
+            loader = nullptr;
+            currentDocument->getPara(0)->addLine(currentDocument->newLine());
+            currentDocument->refreshPara(0);
+            clear();
+            mvprintw(0, 0, "Failed to open file: %s\nPress any key to return to editor...", filename.c_str());
+            getch();
+            return;
+        }
+        timeout(0);
+    }
 
-        Para *para = new Para();
-        currentDocument->addParagraph(para);
+    // One step of a background load: handle the key (navigation and cancel
+    // only), move the next batch of lines in, and redraw with progress
+    void continueLoading(int ch)
+    {
+        int numLines = currentDocument->lineCount();
+        bool warned = false;
+        switch (ch)
+        {
+        case ERR:
+            break;
+        case 3:  // CTRL+C
+        case 27: // Esc
+            cancelLoading();
+            screen.setMessage("Loading " + loadingName + " cancelled");
+            screen.render(currentDocument, cursorRow, cursorCol);
+            return;
+        case KEY_UP:
+            cursorRow = max(0, cursorRow - 1);
+            break;
+        case KEY_DOWN:
+            cursorRow = max(0, min(numLines - 1, cursorRow + 1));
+            break;
+        case KEY_PPAGE:
+            cursorRow = max(0, cursorRow - screen.height());
+            break;
+        case KEY_NPAGE:
+            cursorRow = max(0, min(numLines - 1, cursorRow + screen.height()));
+            break;
+        case KEY_LEFT:
+            cursorCol = max(0, cursorCol - 1);
+            break;
+        case KEY_RIGHT:
+            cursorCol++;
+            break;
+        case KEY_HOME:
+            cursorCol = 0;
+            break;
+        case KEY_END:
+            cursorCol = INT_MAX;
+            break;
+        default:
+            screen.setMessage("Read-only while loading, Ctrl+C cancels");
+            warned = true;
+            break;
+        }
+        Line *currentLine = currentDocument->getLine(cursorRow);
+        cursorCol = min(cursorCol, currentLine != nullptr ? currentLine->length() : 0);
+
+        int added = loader->drainInto(currentDocument, currentDocument->getPara(0), 1);
+        currentDocument->refreshPara(0);
+        if (added > 0 && numLines < screen.top + screen.height())
+        {
+            screen.markAll(); // New lines landed on screen
+        }
 
-        string lineText;
-        while (getline(file, lineText))
+        if (loader->finished())
         {
-            Line *line = new Line();
-            for (char ch : lineText)
+            finishLoading();
+        }
+        else
+        {
+            char text[160];
+            if (loader->progress() >= 0)
+            {
+                snprintf(text, sizeof(text), "Loading %s: %d%% (%d lines), Ctrl+C cancels",
+                         loadingName.c_str(), (int)(loader->progress() * 100), currentDocument->lineCount());
+            }
+            else
+            {
+                snprintf(text, sizeof(text), "Loading %s: %d lines, Ctrl+C cancels",
+                         loadingName.c_str(), currentDocument->lineCount());
+            }
+            if (!warned)
             {
-                line->insertCharAt(line->length(), ch);
+                screen.setMessage(text);
             }
-            para->addLine(line);
+            // Poll quickly while batches are queued, otherwise wait a little
+            timeout(added > 0 ? 0 : 50);
         }
+        screen.render(currentDocument, cursorRow, cursorCol);
+    }
 
-        file.close();
-        cursorRow = para->lineCount() - 1;
-        cursorCol = para->getLine(cursorRow)->length();
+    void finishLoading()
+    {
+        Para *para = currentDocument->getPara(0);
+        if (para->lineCount() == 0)
+        {
+            para->addLine(currentDocument->newLine());
+            currentDocument->refreshPara(0);
+        }
+        currentDocument->enableLiveStats(liveStats); // One parallel pass, then kept up to date
+        lastLoadReport = loader->failed() ? "Error while reading " + loadingName : loader->report();
+        screen.setMessage(lastLoadReport);
+        screen.markAll();
+        delete loader;
+        loader = nullptr;
+        timeout(-1);
+    }
+
+    // Wait for a background load to complete (used outside the key loop)
+    void waitForLoad()
+    {
+        if (loader == nullptr)
+        {
+            return;
+        }
+        loader->wait();
+        loader->drainInto(currentDocument, currentDocument->getPara(0), INT_MAX);
+        currentDocument->refreshPara(0);
+        finishLoading();
+    }
+
+    // Stop a background load and drop the partial document
+    void cancelLoading()
+    {
+        if (loader == nullptr)
+        {
+            return;
+        }
+        loader->cancel();
+        delete loader;
+        loader = nullptr;
+        delete currentDocument;
+        currentDocument = new Document();
+        Para *para = currentDocument->newPara();
+        para->addLine(currentDocument->newLine());
+        currentDocument->addParagraph(para);
+        currentDocument->enableLiveStats(liveStats);
+        cursorRow = 0;
+        cursorCol = 0;
+        screen.reset();
+        timeout(-1);
+    }
+
+    // Document Info
+    // Undo or redo one step and put the cursor where it changed the text
+    void undoStep(bool redo)
+    {
+        int row = cursorRow;
+        int col = cursorCol;
+        if (redo ? currentDocument->redo(row, col) : currentDocument->undo(row, col))
+        {
+            cursorRow = min(row, currentDocument->lineCount() - 1);
+            cursorCol = min(col, currentDocument->getLine(cursorRow)->length());
+        }
+    }
+
+    void showDocumentInfo()
+    {
+        clear();
+        string linesMessage = "Lines: " + std::to_string(currentDocument->lineCount()) +
+                              "  Paragraphs: " + std::to_string(currentDocument->paraCount());
+        string arenaMessage = "Node arena: " + std::to_string(currentDocument->arenaBytesInUse() / 1024) +
+                              " KB in use, " + std::to_string(currentDocument->arenaBytesReserved() / 1024) +
+                              " KB reserved";
+        mvprintw(4, 0, linesMessage.c_str());
+        mvprintw(5, 0, arenaMessage.c_str());
+        const UndoLog &history = currentDocument->history;
+        mvprintw(6, 0, "Undo: %d steps, %d to redo, %zu KB in memory, %lld KB on disk",
+                 history.undoCount(), history.redoCount(), history.memoryUsed() / 1024, history.diskUsed() / 1024);
+        if (!lastLoadReport.empty())
+        {
+            mvprintw(7, 0, lastLoadReport.c_str());
+        }
+        getch();
     }
 
     void findWordPrompt()
     {
         clear();
-        mvprintw(0, 0, "Enter word to find: ");
+        mvprintw(0, 0, regexMode ? "Enter regex to find: " : "Enter word to find: ");
         echo();
         char word[256];
         getnstr(word, 255);
@@ -571,9 +6679,30 @@ public:
         noecho();
 
         bool caseSensitive = (caseChoice == 'y' || caseChoice == 'Y');
-        if (currentDocument->findWord(word, caseSensitive))
+        auto started = chrono::steady_clock::now();
+        vector<TextMatch> matches;
+        if (regexMode)
         {
-            mvprintw(1, 0, "Word found!");
+            Regex regex(word, caseSensitive);
+            if (!checkRegex(regex, 1))
+            {
+                return;
+            }
+            matches = currentDocument->findPattern(regex);
+        }
+        else
+        {
+            matches = currentDocument->findWord(word, caseSensitive);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        searchResults.show(matches);
+        if (!matches.empty())
+        {
+            // Leave the cursor on the first match
+            cursorRow = matches[0].row;
+            cursorCol = matches[0].col;
+            mvprintw(1, 0, "Word found! %d matches, first at line %d, column %d (%.3f s)",
+                     (int)matches.size(), cursorRow + 1, cursorCol + 1, seconds);
         }
         else
         {
@@ -582,77 +6711,378 @@ public:
         getch();
     }
 
-    string getWordUnderCursor(Line *line, int cursorCol)
+    // Say why a regex does not compile; returns false if it does not
+    bool checkRegex(const Regex &regex, int row)
+    {
+        if (regex.valid())
+        {
+            return true;
+        }
+        mvprintw(row, 0, "Invalid regex: %s", regex.error().c_str());
+        getch();
+        return false;
+    }
+
+    // Search for every pattern listed in a file in one pass (F7). Each hit is
+    // listed with its line and column, on screen up to a page of them and
+    // optionally all of them in an output file.
+    void multiPatternSearch()
+    {
+        clear();
+        mvprintw(0, 0, "Pattern file (one pattern per line): ");
+        echo();
+        char patternFile[256];
+        getnstr(patternFile, 255);
+        mvprintw(2, 0, "Write every hit to (empty to only show them): ");
+        char hitFile[256];
+        getnstr(hitFile, 255);
+        noecho();
+
+        ifstream in(patternFile);
+        if (!in)
+        {
+            mvprintw(4, 0, "Cannot open pattern file %s", patternFile);
+            getch();
+            return;
+        }
+        vector<string> patterns;
+        unordered_set<string> seen;
+        string pattern;
+        while (getline(in, pattern))
+        {
+            if (!pattern.empty() && seen.insert(pattern).second)
+            {
+                patterns.push_back(pattern);
+            }
+        }
+        if (patterns.empty())
+        {
+            mvprintw(4, 0, "No patterns in %s", patternFile);
+            getch();
+            return;
+        }
+        ofstream out;
+        if (hitFile[0] != '\0')
+        {
+            out.open(hitFile);
+        }
+
+        auto started = chrono::steady_clock::now();
+        MultiSearch search(patterns);
+        double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        int shown = LINES - 4; // Hits that fit on the result screen
+        vector<pair<TextMatch, int>> firstHits;
+        long long hits = 0;
+        long long bytes = 0;
+        int row = 0;
+        started = chrono::steady_clock::now();
+        for (auto para : currentDocument->paragraphs)
+        {
+            for (auto line : para->lines)
+            {
+                string_view content = line->view();
+                search.scan(content, [&](int index, size_t col)
+                            {
+                                if ((int)firstHits.size() < shown)
+                                {
+                                    firstHits.push_back({{row, (int)col, (int)search.pattern(index).size()}, index});
+                                }
+                                if (out.is_open())
+                                {
+                                    out << row + 1 << ':' << col + 1 << '\t' << search.pattern(index) << '\n';
+                                }
+                                hits++;
+                            });
+                bytes += content.size();
+                row++;
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        clear();
+        mvprintw(0, 0, "%d patterns (%d states, built in %.3f s): %lld hits in %.3f s, %.0f MB/s",
+                 search.patternCount(), search.stateCount(), buildSeconds, hits, seconds,
+                 bytes / (1024.0 * 1024.0) / max(seconds, 1e-6));
+        for (int i = 0; i < (int)firstHits.size(); ++i)
+        {
+            mvprintw(i + 2, 0, "Ln %d, Col %d: %s", firstHits[i].first.row + 1, firstHits[i].first.col + 1,
+                     search.pattern(firstHits[i].second).c_str());
+        }
+        if (hits > (long long)firstHits.size())
+        {
+            mvprintw(LINES - 1, 0, "... and %lld more%s", hits - (long long)firstHits.size(),
+                     out.is_open() ? ", all written to the hit file" : "");
+        }
+        if (!firstHits.empty())
+        {
+            // Leave the cursor on the first hit
+            cursorRow = firstHits[0].first.row;
+            cursorCol = firstHits[0].first.col;
+        }
+        getch();
+    }
+
+    // Turn the word index on or off (F8); it then stays on for files opened
+    // later and is updated as they load
+    void toggleWordIndex()
     {
-        int start = cursorCol;
-        int end = cursorCol;
+        indexWords = !indexWords;
+        auto started = chrono::steady_clock::now();
+        currentDocument->enableWordIndex(indexWords);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-        // Find the start of the word
-        while (start > 0 && isalnum(line->getContent()[start - 1]))
+        clear();
+        if (indexWords)
         {
-            --start;
+            WordIndex *words = currentDocument->words;
+            mvprintw(4, 0, "Word index on: %lld words, %d distinct, built in %.3f s",
+                     words->totalWords(), words->distinctWords(), seconds);
         }
+        else
+        {
+            mvprintw(4, 0, "Word index off");
+        }
+        getch();
+    }
 
-        // Find the end of the word
-        while (end < line->getContent().length() && isalnum(line->getContent()[end]))
+    // Move to the next occurrence of the word under the cursor (F9)
+    void jumpToNextWord()
+    {
+        if (currentDocument->words == nullptr)
         {
-            ++end;
+            screen.setMessage("F9 needs the word index, press F8 to build it");
+            return;
+        }
+        Line *line = currentDocument->getLine(cursorRow);
+        string_view content = line->view();
+        auto [start, end] = Tokenizer::wordAt(content, cursorCol, Tokenizer::Spaces);
+        if (start == end)
+        {
+            screen.setMessage("No word under the cursor");
+            return;
         }
 
-        return line->getContent().substr(start, end - start);
+        string word(content.substr(start, end - start));
+        int row = cursorRow;
+        int col = start;
+        bool wrapped;
+        if (currentDocument->nextWord(word, row, col, wrapped))
+        {
+            cursorRow = row;
+            cursorCol = col;
+            const WordIndex::Word *entry = currentDocument->words->find(word);
+            screen.setMessage(word + ": " + to_string(entry->count) + " occurrences in " +
+                              to_string(entry->lines.size()) + " lines" + (wrapped ? " (wrapped)" : ""));
+        }
     }
-    // Function to convert the word under the cursor to uppercase
-    void convertWordToUpperCase()
+
+    // Build a suffix index for substring queries, or drop it (F11). A file
+    // that is still unedited is indexed where it is mapped, and its index is
+    // kept next to it as <file>.sa so it loads instantly the next time;
+    // otherwise a copy of the text is indexed. Any edit retires the index.
+    void toggleSuffixIndex()
     {
-        Line *currentLine = currentDocument->getLine(cursorRow);
-        string word = getWordUnderCursor(currentLine, cursorCol);
+        Document *document = currentDocument;
+        clear();
+        if (document->currentSuffixes() != nullptr)
+        {
+            document->setSuffixes(nullptr);
+            mvprintw(4, 0, "Suffix index off");
+            getch();
+            return;
+        }
+
+        struct stat fileStat;
+        bool fromFile = document->unedited() && document->source != nullptr &&
+                        stat(document->fileName.c_str(), &fileStat) == 0 &&
+                        (size_t)fileStat.st_size == document->source->size();
+        size_t size = fromFile ? document->source->size() : document->spanCount();
+        if (!SuffixIndex::fits(size))
+        {
+            mvprintw(4, 0, "The document is too large for a suffix index (4 GB at most)");
+            getch();
+            return;
+        }
 
-        // Convert the word to uppercase
-        transform(word.begin(), word.end(), word.begin(), ::toupper);
+        mvprintw(4, 0, "Building suffix index over %.1f MB...", size / (1024.0 * 1024.0));
+        refresh();
+        auto started = chrono::steady_clock::now();
+        SuffixIndex *index;
+        const char *how = "built";
+        if (fromFile)
+        {
+            index = new SuffixIndex(string_view(document->source->data(), document->source->size()));
+            string indexName = document->fileName + ".sa";
+            if (index->load(indexName, fileStat))
+            {
+                how = "loaded";
+            }
+            else
+            {
+                index->build();
+                how = index->save(indexName, fileStat) ? "built and saved" : "built (could not save)";
+            }
+        }
+        else
+        {
+            index = new SuffixIndex(document->textCopy());
+            index->build();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        document->setSuffixes(index);
+
+        clear();
+        mvprintw(4, 0, "Suffix index on: %.1f MB %s in %.3f s with %d threads",
+                 size / (1024.0 * 1024.0), how, seconds, SuffixIndex::threadCount());
+        getch();
+    }
+
+    // Bounds [start, end) of the word touching the cursor column
+    void wordBoundsAt(Line *line, int cursorCol, int &start, int &end)
+    {
+        tie(start, end) = Tokenizer::wordAt(line->view(), cursorCol, Tokenizer::NonAlnum);
+    }
+
+    string getWordUnderCursor(Line *line, int cursorCol)
+    {
+        int start, end;
+        wordBoundsAt(line, cursorCol, start, end);
+        return string(line->view().substr(start, end - start));
+    }
 
-        // Replace the word in the line
-        int start = cursorCol - word.length();
-        for (int i = 0; i < word.length(); ++i)
+    // Replace the word under the cursor with `convert` applied to each letter
+    void convertWordUnderCursor(int (*convert)(int))
+    {
+        int paraIndex, localRow;
+        if (!currentDocument->locateRow(cursorRow, paraIndex, localRow))
         {
-            currentLine->removeCharAt(start + i);
-            currentLine->insertCharAt(start + i, word[i]);
+            return;
         }
+        Line *currentLine = currentDocument->getPara(paraIndex)->getLine(localRow);
+        int start, end;
+        wordBoundsAt(currentLine, cursorCol, start, end);
+        string word = currentLine->getContent().substr(start, end - start);
+        transform(word.begin(), word.end(), word.begin(), convert);
+
+        EditBatch batch;
+        batch.add(paraIndex, currentLine, start, word.length(), word);
+        currentDocument->apply(batch);
+    }
+    // Function to convert the word under the cursor to uppercase
+    void convertWordToUpperCase()
+    {
+        convertWordUnderCursor(::toupper);
     }
     // Function to convert the word under the cursor to lowercase
     void convertWordToLowerCase()
     {
-        Line *currentLine = currentDocument->getLine(cursorRow);
-        string word = getWordUnderCursor(currentLine, cursorCol);
+        convertWordUnderCursor(::tolower);
+    }
+    // Every match of a literal text, from the suffix index when there is one
+    vector<TextMatch> findAll(const string &text)
+    {
+        SuffixIndex *index = currentDocument->currentSuffixes();
+        if (index == nullptr || text.empty())
+        {
+            return currentDocument->findWord(text, true);
+        }
+        vector<TextMatch> matches;
+        for (uint32_t offset : index->positions(text))
+        {
+            TextMatch match{0, 0, (int)text.size()};
+            if (currentDocument->locate(offset, match.row, match.col))
+            {
+                matches.push_back(match);
+            }
+        }
+        return matches;
+    }
+
+    // Keep the matches for highlighting and F10, and put the cursor on the
+    // first one. Returns false if there are none.
+    bool showAll(const vector<TextMatch> &matches)
+    {
+        searchResults.show(matches);
+        if (matches.empty())
+        {
+            return false;
+        }
+        cursorRow = matches[0].row;
+        cursorCol = matches[0].col;
+        return true;
+    }
+
+    // Search as you type (Ctrl+S). The cursor goes to the first match at or
+    // after where the search started and every match is highlighted; Enter
+    // keeps the matches for F10 / Shift+F10 and Esc goes back.
+    void incrementalSearch()
+    {
+        int startRow = cursorRow;
+        int startCol = cursorCol;
+        searchResults.clear();
+        while (true)
+        {
+            string status = "Search: " + searchResults.text();
+            if (!searchResults.text().empty())
+            {
+                status += "  (" + to_string(searchResults.size()) + (searchResults.truncated() ? "+" : "") + " matches)";
+            }
+            screen.setMessage(status + "  Enter: keep, Esc: cancel");
+            screen.markAll();
+            screen.render(currentDocument, cursorRow, cursorCol);
 
-        // Convert the word to lowercase
-        transform(word.begin(), word.end(), word.begin(), ::tolower);
+            int ch = getch();
+            if (ch == 10)
+            {
+                break;
+            }
+            if (ch == 27)
+            {
+                searchResults.clear();
+                cursorRow = startRow;
+                cursorCol = startCol;
+                break;
+            }
+            if (ch == KEY_BACKSPACE || ch == 127)
+            {
+                searchResults.shorten();
+            }
+            else if (ch >= 32 && ch <= 126)
+            {
+                searchResults.extend(currentDocument, ch);
+            }
+            else
+            {
+                continue;
+            }
 
-        // Replace the word in the line
-        int start = cursorCol - word.length();
-        for (int i = 0; i < word.length(); ++i)
+            int index = searchResults.firstFrom(startRow, startCol);
+            cursorRow = index >= 0 ? searchResults.at(index).row : startRow;
+            cursorCol = index >= 0 ? searchResults.at(index).col : startCol;
+        }
+        if (searchResults.size() == 0)
         {
-            currentLine->removeCharAt(start + i);
-            currentLine->insertCharAt(start + i, word[i]);
+            searchResults.clear();
         }
     }
-    // Find Sentence
-    bool findSentence(const string &sentence)
+
+    // Move to the next (F10) or previous (Shift+F10) match of the last search
+    void stepToMatch(bool forward)
     {
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
+        if (!searchResults.active() || searchResults.size() == 0)
         {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                if (line->getContent().find(sentence) != string::npos)
-                {
-                    return true; // Sentence found
-                }
-            }
+            screen.setMessage("No matches to step through; search with Ctrl+S or a find command");
+            return;
         }
-        return false; // Sentence not found
+        int index = forward ? searchResults.after(cursorRow, cursorCol) : searchResults.before(cursorRow, cursorCol);
+        cursorRow = searchResults.at(index).row;
+        cursorCol = searchResults.at(index).col;
+        screen.setMessage("Match " + to_string(index + 1) + " of " + to_string(searchResults.size()) +
+                          (searchResults.truncated() ? "+" : ""));
     }
 
+    // Find Sentence
     void findSentencePromt()
     {
         clear();
@@ -661,9 +7091,10 @@ public:
         char word[1000];
         getstr(word);
         noecho();
-        if (findSentence(word))
+        if (showAll(findAll(word)))
         {
-            mvprintw(1, 0, "Sentence found!");
+            mvprintw(1, 0, "Sentence found! %d matches, first at line %d, column %d. F10 / Shift+F10 step through them.",
+                     searchResults.size(), cursorRow + 1, cursorCol + 1);
         }
         else
         {
@@ -672,23 +7103,6 @@ public:
         getch();
     }
     // Find Substring
-    bool findSubstring(const string &substring)
-    {
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
-        {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                if (line->getContent().find(substring) != string::npos)
-                {
-                    return true; // Substring found
-                }
-            }
-        }
-        return false; // Substring not found
-    }
-
     void findSubstringPrompt()
     {
         clear();
@@ -697,9 +7111,10 @@ public:
         char word[1000];
         getstr(word);
         noecho();
-        if (findSubstring(word))
+        if (showAll(findAll(word)))
         {
-            mvprintw(1, 0, "Substring found!");
+            mvprintw(1, 0, "Substring found! %d matches, first at line %d, column %d. F10 / Shift+F10 step through them.",
+                     searchResults.size(), cursorRow + 1, cursorCol + 1);
         }
         else
         {
@@ -707,106 +7122,213 @@ public:
         }
         getch();
     }
-    // replace first word
-    void replaceFirstWord(const string &oldWord, const string &newWord)
+    // Replace `oldText` by `newText` in every line, taking at most `perLine`
+    // matches from each line and `limit` overall (-1 for no limit). Returns
+    // the number of replacements.
+    int replaceText(const string &oldText, const string &newText, int perLine, int limit)
+    {
+        if (oldText.empty())
+        {
+            return 0;
+        }
+        TextSearch search(oldText);
+        return replaceInChunks(limit, [&](const Document::LineChunk &chunk, int budget, EditBatch &batch)
+                               { chunk.forEach([&](int, Line *line)
+                                               {
+                                                   string_view content = line->view();
+                                                   int inLine = 0;
+                                                   size_t pos = 0;
+                                                   while (inLine != perLine && batch.size() != budget &&
+                                                          (pos = search.find(content, pos)) != string_view::npos)
+                                                   {
+                                                       batch.add(chunk.para, line, pos, oldText.length(), newText);
+                                                       pos += oldText.length();
+                                                       inLine++;
+                                                   } }); });
+    }
+    // replaceText() for a regular expression; `replacement` may refer to
+    // groups as \0 to \9
+    int replacePattern(const Regex &regex, const string &replacement, int perLine, int limit)
+    {
+        vector<Regex> perThread(WorkPool::shared().threadCount(), regex); // One DFA cache per thread
+        return replaceInChunks(limit, [&](const Document::LineChunk &chunk, int budget, EditBatch &batch)
+                               {
+                                   Regex &local = perThread[WorkPool::threadIndex()];
+                                   vector<int> groups;
+                                   chunk.forEach([&](int, Line *line)
+                                                 {
+                                                     string_view content = line->view();
+                                                     int inLine = 0;
+                                                     size_t from = 0;
+                                                     if (batch.size() == budget || !local.matches(content))
+                                                     {
+                                                         return;
+                                                     }
+                                                     while (inLine != perLine && batch.size() != budget && from <= content.size() &&
+                                                            local.find(content, from, groups))
+                                                     {
+                                                         batch.add(chunk.para, line, groups[0], groups[1] - groups[0],
+                                                                   Regex::expand(content, groups, replacement));
+                                                         from = groups[1] > groups[0] ? groups[1] : groups[1] + 1;
+                                                         inLine++;
+                                                     } }); });
+    }
+    // Drive a replace over the document's line chunks. scan(chunk, budget,
+    // batch) records up to `budget` edits (-1 for any number) for one chunk.
+    // Replace-all scans a window of chunks at a time on the WorkPool, then
+    // applies their batches in document order, so memory stays bounded and
+    // the tree is only ever changed from this thread. A limited replace
+    // stops early, so it goes one chunk at a time.
+    template <class Scan>
+    int replaceInChunks(int limit, Scan scan)
     {
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
+        vector<Document::LineChunk> chunks = currentDocument->lineChunks();
+        WorkPool &pool = WorkPool::shared();
+        size_t window = limit < 0 ? pool.threadCount() * 4 : 1;
+        int found = 0;
+        for (size_t first = 0; first < chunks.size() && found != limit; first += window)
         {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
+            size_t count = min(window, chunks.size() - first);
+            vector<EditBatch> batches(count);
+            pool.forEach(count, [&](size_t i)
+                         { scan(chunks[first + i], limit < 0 ? -1 : limit - found, batches[i]); });
+            for (auto &batch : batches)
             {
-                Line *line = para->getLine(j);
-                size_t pos = line->getContent().find(oldWord);
-                if (pos != string::npos)
-                {
-                    int count = line->length();
-                    string temp = line->getContent();
-                    temp.replace(pos, oldWord.length(), newWord);
-
-                    for (int i = count - 1; i >= 0; --i)
-                    {
-                        line->removeCharAt(i);
-                    }
-                    int k = 0;
-                    for (int i = 0; i < temp.size(); i++)
-                    {
-                        char c = temp[k++];
-                        line->insertCharAt(i, c);
-                    }
-                    return; // Stop after replacing the first occurrence
-                }
+                found += batch.size();
+                currentDocument->apply(batch);
             }
         }
+        return found;
+    }
+    // replace first word
+    void replaceFirstWord(const string &oldWord, const string &newWord)
+    {
+        replaceText(oldWord, newWord, 1, 1);
     }
     // replace first word prompt
     void replaceFirstWordPrompt()
     {
         clear();
-        mvprintw(0, 0, "Enter word to replace: ");
+        mvprintw(0, 0, regexMode ? "Enter regex to replace: " : "Enter word to replace: ");
         echo();
         char word[256];
         getnstr(word, 255);
         noecho();
 
-        mvprintw(2, 0, "Enter new word: ");
+        mvprintw(2, 0, regexMode ? "Enter replacement (\\1 for group 1): " : "Enter new word: ");
         echo();
         char word1[256];
         getnstr(word1, 255);
         noecho();
 
-        replaceFirstWord(word, word1);
-        mvprintw(4, 0, "Word replace!");
+        if (regexMode)
+        {
+            Regex regex(word);
+            if (!checkRegex(regex, 4))
+            {
+                return;
+            }
+            int replaced = replacePattern(regex, word1, 1, 1);
+            mvprintw(4, 0, "Replaced %d matches", replaced);
+        }
+        else
+        {
+            replaceFirstWord(word, word1);
+            mvprintw(4, 0, "Word replace!");
+        }
 
         getch();
     }
     // replace all word
     void replaceAllWords(const string &oldWord, const string &newWord)
     {
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
-        {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                string content = line->getContent();
-                size_t pos = 0;
-                while ((pos = content.find(oldWord, pos)) != string::npos)
-                {
-                    content.replace(pos, oldWord.length(), newWord);
-                    pos += newWord.length();
-                }
+        replaceText(oldWord, newWord, -1, -1);
+    }
+    // replace all word prompt
+    void replaceAllWordPrompt()
+    {
+        clear();
+        mvprintw(0, 0, regexMode ? "Enter regex to replace: " : "Enter word to replace: ");
+        echo();
+        char word[256];
+        getnstr(word, 255);
+        noecho();
 
-                for (int k = line->length() - 1; k >= 0; --k)
-                {
-                    line->removeCharAt(k);
-                }
+        mvprintw(2, 0, regexMode ? "Enter replacement (\\1 for group 1): " : "Enter new word: ");
+        echo();
+        char word1[256];
+        getnstr(word1, 255);
+        noecho();
 
-                for (size_t k = 0; k < content.size(); ++k)
-                {
-                    line->insertCharAt(k, content[k]);
-                }
+        if (regexMode)
+        {
+            Regex regex(word);
+            if (!checkRegex(regex, 4))
+            {
+                return;
             }
+            int replaced = replacePattern(regex, word1, -1, -1);
+            mvprintw(4, 0, "Replaced %d matches", replaced);
+        }
+        else
+        {
+            replaceAllWords(word, word1);
+            mvprintw(4, 0, "Word replace!");
         }
+
+        getch();
     }
-    // replace all word prompt
-    void replaceAllWordPrompt()
+    // Replace all matches in a file on disk without opening it (F12), for
+    // files too big to load. Follows the regex mode of the editor.
+    void streamReplacePrompt()
     {
         clear();
-        mvprintw(0, 0, "Enter word to replace: ");
+        mvprintw(0, 0, "Enter file to rewrite (empty for the open file): ");
+        echo();
+        char path[256];
+        getnstr(path, 255);
+        noecho();
+        string target = path[0] != '\0' ? path : currentDocument->fileName;
+        if (target.empty())
+        {
+            mvprintw(2, 0, "No file is open");
+            getch();
+            return;
+        }
+
+        mvprintw(2, 0, regexMode ? "Enter regex to replace: " : "Enter text to replace: ");
         echo();
         char word[256];
         getnstr(word, 255);
         noecho();
 
-        mvprintw(2, 0, "Enter new word: ");
+        mvprintw(4, 0, regexMode ? "Enter replacement (\\1 for group 1): " : "Enter new text: ");
         echo();
         char word1[256];
         getnstr(word1, 255);
         noecho();
 
-        replaceAllWords(word, word1);
-        mvprintw(4, 0, "Word replace!");
-
+        Regex regex(regexMode ? word : "");
+        if (!checkRegex(regex, 6))
+        {
+            return;
+        }
+        mvprintw(6, 0, "Rewriting %s...", target.c_str());
+        refresh();
+        StreamReplace replace = regexMode ? StreamReplace(regex, word1) : StreamReplace(word, word1);
+        if (!replace.run(target))
+        {
+            mvprintw(6, 0, "Replace failed: %s; %s is unchanged", replace.error().c_str(), target.c_str());
+            getch();
+            return;
+        }
+        mvprintw(6, 0, "Replaced %lld matches in %.1f MB in %.3f s, %.0f MB/s",
+                 replace.replaced, replace.bytesRead / (1024.0 * 1024.0), replace.seconds,
+                 replace.bytesRead / (1024.0 * 1024.0) / max(replace.seconds, 1e-6));
+        if (target == currentDocument->fileName)
+        {
+            mvprintw(7, 0, "The editor still shows the old text; reopen the file (Ctrl+O) to see the changes");
+        }
         getch();
     }
     // Add Prefix to Word
@@ -825,34 +7347,8 @@ public:
         getnstr(word1, 255);
         noecho();
 
-        for (int i = 0; i < currentDocument->paraCount(); i++)
-        {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                size_t pos = line->getContent().find(word);
-                if (pos != string::npos)
-                {
-                    int count = line->length();
-                    string temp = line->getContent();
-                    string temp1 = word1;
-                    string oldWord = word;
-                    temp1.append(word);
-                    temp.replace(pos, oldWord.length(), temp1);
-                    for (int i = count - 1; i >= 0; --i)
-                    {
-                        line->removeCharAt(i);
-                    }
-                    int k = 0;
-                    for (int i = 0; i < temp.size(); i++)
-                    {
-                        char c = temp[k++];
-                        line->insertCharAt(i, c);
-                    }
-                }
-            }
-        }
+        // Only the first occurrence in each line gets the prefix
+        replaceText(word, string(word1) + word, 1, -1);
         mvprintw(4, 0, "Prefix Added!");
         getch();
     }
@@ -872,125 +7368,236 @@ public:
         getnstr(word1, 255);
         noecho();
 
-        for (int i = 0; i < currentDocument->paraCount(); i++)
-        {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                size_t pos = line->getContent().find(word);
-                if (pos != string::npos)
-                {
-                    int count = line->length();
-                    string temp = line->getContent();
-                    string temp1 = word;
-                    string oldWord = word;
-                    temp1.append(word1);
-                    temp.replace(pos, oldWord.length(), temp1);
-                    for (int i = count - 1; i >= 0; --i)
-                    {
-                        line->removeCharAt(i);
-                    }
-                    int k = 0;
-                    for (int i = 0; i < temp.size(); i++)
-                    {
-                        char c = temp[k++];
-                        line->insertCharAt(i, c);
-                    }
-                }
-            }
-        }
+        // Only the first occurrence in each line gets the postfix
+        replaceText(word, string(word) + word1, 1, -1);
         mvprintw(4, 0, "Postfix Added!");
         getch();
     }
     // Word Lenght
     void avgWordLength()
     {
-        int totalLength = 0, wordCount = 0;
+        long long totalLength = 0, wordCount = 0;
 
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
+        if (currentDocument->words != nullptr)
         {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                string content = line->getContent();
-
-                stringstream ss(content);
-                string word;
-
-                while (ss >> word)
-                {
-                    totalLength += word.length();
-                    wordCount++;
-                }
-            }
+            totalLength = currentDocument->words->totalChars();
+            wordCount = currentDocument->words->totalWords();
+        }
+        else
+        {
+            TextStats stats = currentDocument->statistics();
+            totalLength = stats.wordChars;
+            wordCount = stats.words;
         }
         clear();
         string resultMessage = "Word Count is: " + std::to_string(wordCount);
 
         // Display the message
         mvprintw(4, 0, resultMessage.c_str());
+        if (wordCount > 0)
+        {
+            mvprintw(5, 0, "Average word length: %.2f", (double)totalLength / wordCount);
+        }
         getch();
     }
     // Substring Count
     void substringCount()
     {
         clear();
-        mvprintw(0, 0, "Enter substring to find count: ");
+        mvprintw(0, 0, regexMode ? "Enter regex to count: " : "Enter substring to find count: ");
         echo();
         char word[256];
         getnstr(word, 255);
         noecho();
         int count = 0;
-        string substring = word;
-
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
+        long long bytes = 0;
+        TextSearch search(word);
+        Regex regex(regexMode ? word : "");
+        if (!checkRegex(regex, 1))
         {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                string content = line->getContent();
+            return;
+        }
+        SuffixIndex *index = regexMode ? nullptr : currentDocument->currentSuffixes();
+        auto started = chrono::steady_clock::now();
 
-                size_t pos = 0;
-                while ((pos = content.find(substring, pos)) != string::npos)
-                {
-                    count++;
-                    pos += substring.length();
-                }
-            }
+        if (index != nullptr && word[0] != '\0')
+        {
+            // Lines hold no newlines, so no match can span two of them
+            count = index->countNonOverlapping(word);
+        }
+        else
+        {
+            // Per chunk: matches, bytes scanned
+            using Tally = pair<long long, long long>;
+            vector<Regex> perThread(WorkPool::shared().threadCount(), regex); // One DFA cache per thread
+            Tally total = currentDocument->reduceLines(Tally(0, 0), [&](const Document::LineChunk &chunk)
+                                                       {
+                                                           Regex &local = perThread[WorkPool::threadIndex()];
+                                                           Tally tally(0, 0);
+                                                           chunk.forEach([&](int, Line *line)
+                                                                         {
+                                                                             string_view content = line->view();
+                                                                             tally.first += regexMode ? local.count(content) : search.count(content);
+                                                                             tally.second += content.size();
+                                                                         });
+                                                           return tally; },
+                                                       [](Tally a, Tally b)
+                                                       { return Tally(a.first + b.first, a.second + b.second); });
+            count = total.first;
+            bytes = total.second;
         }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
         clear();
         string resultMessage = "Substring Count is: " + std::to_string(count);
 
         // Display the message
         mvprintw(4, 0, resultMessage.c_str());
+        if (index != nullptr && word[0] != '\0')
+        {
+            mvprintw(5, 0, "Looked up in the suffix index in %.6f s", seconds);
+        }
+        else
+        {
+            mvprintw(5, 0, "Scanned %.1f MB in %.3f s with %s: %.0f MB/s, %.0f matches/s",
+                     bytes / (1024.0 * 1024.0), seconds, regexMode ? "the regex DFA" : TextSearch::kernel(),
+                     bytes / (1024.0 * 1024.0) / max(seconds, 1e-6), count / max(seconds, 1e-6));
+        }
 
         getch();
     }
-    // Special Character Count
-    void specialCharCount()
+    // Every statistic of the document from one pass over it (Ctrl+Q)
+    void statisticsReport()
     {
-        int count = 0;
+        auto started = chrono::steady_clock::now();
+        TextStats stats = currentDocument->statistics();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        double megabytes = (stats.chars + stats.lines) / (1024.0 * 1024.0);
+
+        clear();
+        mvprintw(0, 0, "Document statistics");
+        mvprintw(2, 0, "Lines:               %lld (%lld blank)", stats.lines, stats.blankLines);
+        mvprintw(3, 0, "Paragraphs:          %d (%d with text)", stats.paragraphs, stats.textParagraphs);
+        mvprintw(4, 0, "Characters:          %lld, not counting newlines", stats.chars);
+        mvprintw(5, 0, "Words:               %lld", stats.words);
+        if (stats.words > 0)
+        {
+            mvprintw(6, 0, "Word length:         %d to %d, %.2f on average", stats.shortestWord, stats.longestWord,
+                     (double)stats.wordChars / stats.words);
+        }
+        mvprintw(7, 0, "Sentences:           %lld", stats.sentences);
+        mvprintw(8, 0, "Special characters:  %lld", stats.special);
+        mvprintw(10, 0, "Scanned %.1f MB in %.3f s, %.0f MB/s", megabytes, seconds, megabytes / max(seconds, 1e-6));
+        getch();
+    }
+    // Most frequent words with a bar for each, which can be saved as CSV
+    // (Ctrl+\)
+    void wordFrequencyReport()
+    {
+        clear();
+        mvprintw(0, 0, "How many top words (default 20): ");
+        echo();
+        char input[32];
+        getnstr(input, 31);
+        noecho();
+        long long wanted = atoll(input);
+        size_t k = wanted > 0 ? wanted : 20;
+
+        mvprintw(2, 0, "Counting words...");
+        refresh();
+        auto started = chrono::steady_clock::now();
+        vector<WordCounts> counts = currentDocument->wordFrequencies();
+        vector<WordCounts::Entry> top = WordCounts::top(counts, k);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        long long total = 0, distinct = 0, once = 0;
+        for (const WordCounts &table : counts)
+        {
+            total += table.total();
+            distinct += table.size();
+            table.forEach([&](const WordCounts::Entry &entry)
+                          { once += entry.count == 1; });
+        }
 
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
+        clear();
+        mvprintw(0, 0, "%lld words, %lld distinct, %lld seen once; counted in %.3f s with %d threads", total, distinct,
+                 once, seconds, WorkPool::shared().threadCount());
+        const int WordWidth = 20;
+        int barWidth = max(1, COLS - WordWidth - 32);
+        int row = 2;
+        for (size_t rank = 0; rank < top.size(); ++rank)
         {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
+            if (row >= LINES - 2)
             {
-                Line *line = para->getLine(j);
-                string content = line->getContent();
+                mvprintw(row, 0, "... %zu more", top.size() - rank);
+                break;
+            }
+            const WordCounts::Entry &entry = top[rank];
+            int bar = max(1LL, entry.count * barWidth / top[0].count);
+            mvprintw(row++, 0, "%4zu %-*.*s %10lld %6.2f%% %s", rank + 1, WordWidth,
+                     (int)min(entry.word.size(), (size_t)WordWidth), entry.word.data(), entry.count,
+                     100.0 * entry.count / total, string(bar, '#').c_str());
+        }
+        mvprintw(LINES - 1, 0, "Press s to save the top %zu as CSV, any other key to return", top.size());
+        if (top.empty() || getch() != 's')
+        {
+            return;
+        }
+
+        mvprintw(LINES - 1, 0, "CSV file: ");
+        clrtoeol();
+        echo();
+        char path[256];
+        getnstr(path, 255);
+        noecho();
+        clear();
+        if (writeFrequencyCsv(path, top, total))
+        {
+            mvprintw(4, 0, "Saved %zu words to %s", top.size(), path);
+        }
+        else
+        {
+            mvprintw(4, 0, "Could not write %s", path);
+        }
+        getch();
+    }
 
-                for (char ch : content)
+    // One row per word: rank, word, count and share of all words, with
+    // words quoted when they hold a comma or quote
+    bool writeFrequencyCsv(const string &path, const vector<WordCounts::Entry> &top, long long total)
+    {
+        ofstream out(path);
+        out << "rank,word,count,percent\n";
+        for (size_t rank = 0; rank < top.size(); ++rank)
+        {
+            string_view word = top[rank].word;
+            out << rank + 1 << ',';
+            if (word.find_first_of(",\"\r\n") == string_view::npos)
+            {
+                out << word;
+            }
+            else
+            {
+                out << '"';
+                for (char c : word)
                 {
-                    if (!isalnum(ch) && !isspace(ch))
+                    if (c == '"')
                     {
-                        count++;
+                        out << '"';
                     }
+                    out << c;
                 }
+                out << '"';
             }
+            char percent[32];
+            snprintf(percent, sizeof(percent), "%.4f", 100.0 * top[rank].count / total);
+            out << ',' << top[rank].count << ',' << percent << '\n';
         }
+        out.close();
+        return !out.fail();
+    }
+    // Special Character Count
+    void specialCharCount()
+    {
+        long long count = currentDocument->statistics().special;
         string resultMessage = "Special Character Count is: " + std::to_string(count);
 
         // Display the message
@@ -1001,56 +7608,21 @@ public:
     // Sentence Count
     void countSentencesAndParagraphs()
     {
-        int sentenceCount = 0, paragraphCount = currentDocument->paraCount();
-
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
-        {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                string content = line->getContent();
-
-                for (char ch : content)
-                {
-                    if (ch == '.' || ch == '!' || ch == '?')
-                    {
-                        sentenceCount++;
-                    }
-                }
-            }
-        }
-
-        // return {sentenceCount, paragraphCount};
-        string resultMessage = "Sentence Count is:" + std::to_string(sentenceCount);
+        TextStats stats = currentDocument->statistics();
+        string resultMessage = "Sentence Count is:" + std::to_string(stats.sentences);
 
         // Display the message
         mvprintw(4, 0, resultMessage.c_str());
+        mvprintw(5, 0, "Paragraph Count is:%d", stats.paragraphs);
 
         getch();
     }
 
     void processDocument(int &minLength, int &maxLength)
     {
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
-        {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                std::string content = line->getContent();
-
-                std::stringstream ss(content);
-                std::string word;
-
-                while (ss >> word)
-                {
-                    int length = static_cast<int>(word.length());
-                    minLength = std::min(minLength, length);
-                    maxLength = std::max(maxLength, length);
-                }
-            }
-        }
+        TextStats stats = currentDocument->statistics();
+        minLength = std::min(minLength, stats.shortestWord);
+        maxLength = std::max(maxLength, stats.longestWord);
     }
     // Smallest word lenght
     void findSmallestWordLength()
@@ -1119,8 +7691,11 @@ public:
 
     void mergeIntoNewFile(const string &file1, const string &file2, const string &newFile)
     {
+        // Written beside the target and renamed over it, so the target can
+        // be one of the inputs or the open document
+        string tempName = newFile + ".saving";
         ifstream infile1(file1), infile2(file2);
-        ofstream outfile(newFile);
+        ofstream outfile(tempName);
 
         if (infile1.is_open() && infile2.is_open() && outfile.is_open())
         {
@@ -1136,12 +7711,14 @@ public:
             infile1.close();
             infile2.close();
             outfile.close();
-            cout << "Files merged into: " << newFile << endl;
-        }
-        else
-        {
-            cerr << "Error opening files!" << endl;
+            if (outfile && Document::replaceFile(tempName, newFile))
+            {
+                cout << "Files merged into: " << newFile << endl;
+                return;
+            }
         }
+        remove(tempName.c_str());
+        cerr << "Error opening files!" << endl;
     }
     // merge file prompt
     void mergefileprompt()
@@ -1175,66 +7752,103 @@ public:
     void findWordsFromInput()
     {
         clear();
-        mvprintw(0, 0, "Enter word to replace: ");
+        mvprintw(0, 0, "Enter letters: ");
         echo();
         char word[256];
         getnstr(word, 255);
+        mvprintw(1, 0, "Dictionary file (empty for this document): ");
+        char path[256];
+        getnstr(path, 255);
         noecho();
+        string_view letters = word;
+        string dictionaryPath = path;
 
-        string inputWord = word;
-
-        unordered_set<string> allWords;
-
-        // Collect all words from the document
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
+        clear();
+        auto started = chrono::steady_clock::now();
+        WordGame documentWords;
+        WordGame *game = &documentWords;
+        const char *how = "collected";
+        if (dictionaryPath.empty())
         {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
+            // Distinct words of the document, from the word index if it is on
+            if (currentDocument->words != nullptr)
             {
-                Line *line = para->getLine(j);
-                string content = line->getContent();
-
-                stringstream ss(content);
-                string word;
-
-                while (ss >> word)
+                currentDocument->words->forEachWord([&](const WordIndex::Word &indexed)
+                                                    { documentWords.add(indexed.spelling); });
+            }
+            else
+            {
+                unordered_set<string_view> seen;
+                for (auto para : currentDocument->paragraphs)
                 {
-                    allWords.insert(word);
+                    for (auto line : para->lines)
+                    {
+                        Tokenizer::forEach(line->view(), Tokenizer::Spaces, [&](string_view text)
+                                           {
+                                               if (seen.insert(text).second)
+                                               {
+                                                   documentWords.add(text);
+                                               }
+                                           });
+                    }
                 }
             }
         }
-
-        // Prepare the input word's character frequency
-        multiset<char> inputChars(inputWord.begin(), inputWord.end());
-
-        // Find smaller words
-        unordered_set<string> smallerWords;
-        for (const auto &word : allWords)
+        else
         {
-            multiset<char> wordChars(word.begin(), word.end());
-            bool canForm = true;
-
-            for (char c : word)
+            // The dictionary stays open for the next game until it changes
+            how = "in memory";
+            if (dictionary == nullptr || dictionaryName != dictionaryPath || dictionary->changed(dictionaryPath))
             {
-                if (inputChars.count(c) < wordChars.count(c))
+                delete dictionary;
+                dictionary = nullptr;
+                mvprintw(4, 0, "Indexing %s...", dictionaryPath.c_str());
+                refresh();
+                WordGame *opened = new WordGame();
+                if (!opened->openDictionary(dictionaryPath, how))
                 {
-                    canForm = false;
-                    break;
+                    delete opened;
+                    clear();
+                    mvprintw(4, 0, "Cannot read %s", dictionaryPath.c_str());
+                    getch();
+                    return;
                 }
+                dictionary = opened;
+                dictionaryName = dictionaryPath;
             }
-
-            if (canForm)
-            {
-                smallerWords.insert(word);
-            }
+            game = dictionary;
         }
+        double indexSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        // A dictionary may list a word more than once
+        started = chrono::steady_clock::now();
+        unordered_set<string_view> found;
+        vector<pair<string_view, bool>> smallerWords;
+        game->formable(letters, [&](string_view text, bool anagram)
+                       {
+                           if (found.insert(text).second)
+                           {
+                               smallerWords.push_back({text, anagram});
+                           }
+                       });
+        double searchSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        // Longest words first
+        sort(smallerWords.begin(), smallerWords.end(), [](const pair<string_view, bool> &a, const pair<string_view, bool> &b)
+             { return a.first.size() != b.first.size() ? a.first.size() > b.first.size() : a.first < b.first; });
 
-        mvprintw(4, 0, "Words that can be formed:");
-        int row = 5;
-
-        for (const auto &word : smallerWords)
+        clear();
+        mvprintw(0, 0, "%zu words %s in %.3f s, searched in %.3f s", game->size(), how, indexSeconds, searchSeconds);
+        mvprintw(1, 0, "%zu words can be formed (* uses every letter):", smallerWords.size());
+        int row = 3;
+        for (const auto &formed : smallerWords)
         {
-            mvprintw(row++, 0, word.c_str());
+            if (row >= LINES - 1)
+            {
+                mvprintw(row, 0, "... %zu more", smallerWords.size() - (row - 3));
+                break;
+            }
+            mvprintw(row++, 0, "%.*s%s", (int)formed.first.size(), formed.first.data(), formed.second ? " *" : "");
         }
 
         getch(); // Wait for user input before exiting
@@ -1242,29 +7856,8 @@ public:
     // Paragraph Count
     void countParagraphs()
     {
-        int paragraphCount = 0;
-        bool inParagraph = false;
-
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
-        {
-            Para *para = currentDocument->getPara(i);
-            bool paraEmpty = true;
-
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                if (!line->getContent().empty()) // Checking if line is non-empty
-                {
-                    paraEmpty = false;
-                    break;
-                }
-            }
-
-            if (!paraEmpty)
-            {
-                paragraphCount++;
-            }
-        }
+        // Paragraphs with at least one non-empty line
+        int paragraphCount = currentDocument->statistics().textParagraphs;
         clear();
         string resultMessage = "Paragraph Count is: " + std::to_string(paragraphCount);
         mvprintw(4, 0, resultMessage.c_str());
@@ -1273,26 +7866,7 @@ public:
     // Find Largest Paragraph Word Lenght
     void findLargestParagraphWordLength()
     {
-        int maxWordLength = 0;
-
-        for (int i = 0; i < currentDocument->paraCount(); ++i)
-        {
-            Para *para = currentDocument->getPara(i);
-            for (int j = 0; j < para->lineCount(); ++j)
-            {
-                Line *line = para->getLine(j);
-                stringstream ss(line->getContent());
-                string word;
-
-                while (ss >> word)
-                {
-                    if (word.length() > maxWordLength)
-                    {
-                        maxWordLength = word.length();
-                    }
-                }
-            }
-        }
+        int maxWordLength = currentDocument->statistics().longestWord;
         clear();
         string resultMessage = "Largest Paragraph Word Lenght Count is: " + std::to_string(maxWordLength);
         mvprintw(4, 0, resultMessage.c_str());
@@ -1371,10 +7945,19 @@ public:
         // Apply RLE encoding
         string encodedContent = runLengthEncode(content);
 
-        // Save the encoded content back to the file
-        ofstream outFile(filePath);
+        // Save the encoded content back to the file. It may be the open
+        // document, whose lines still read the old file, so it is replaced
+        // rather than overwritten.
+        string tempName = filePath + ".saving";
+        ofstream outFile(tempName);
         outFile << encodedContent;
         outFile.close();
+        if (!outFile || !Document::replaceFile(tempName, filePath))
+        {
+            remove(tempName.c_str());
+            cerr << "Encoded file could not be saved!" << endl;
+            return;
+        }
 
         cout << "File encoded using RLE and saved successfully." << endl;
     }
@@ -1396,7 +7979,9 @@ public:
 
     ~TextEditor()
     {
+        cancelLoading();
         delete currentDocument;
+        delete dictionary;
     }
 };
 